@@ -1,4 +1,34 @@
+#pragma once
+#include "ball.hpp"
 #include <iostream>
 #include <string>
 
-void process_args(int argc, char **argv, int &num_balls, int &num_vertices);
\ No newline at end of file
+// Response to the collisions between balls.
+enum class Solver {
+  impulse, // Speed exchange at the time of impact.
+  pbd      // Position-based Jacobi relaxation, for dense piles.
+};
+
+// Simulation options, filled from the command-line arguments.
+struct Sim_Options {
+  int num_balls = 5;       // Balls at start.
+  int max_balls = 1 << 18; // Limit of the balls spawned by emitters.
+  int max_substeps = 4;    // Limit of the sub-steps of each step.
+  int event_capacity = 0;  // Collision events recorded per step, 0 for none.
+  Solver solver = Solver::impulse;
+  int pbd_iterations = 4;      // Relaxation iterations of each sub-step.
+  bool fixed_point = false;    // Steps the balls in fixed point.
+  int seed = -1;               // Seed of the balls, random if negative.
+  int digest_every = 0;        // Prints a digest of the balls every n steps.
+  bool tune = true;            // Tunes the launch sizes missing from cache.
+  std::string tune_dir = ".";  // Directory of the launch size caches.
+  int num_vertices = 40;   // Num of vertices to display each ball.
+  Radius_Dist radius_dist = Radius_Dist::mixed;
+  std::string scene_path; // Static obstacles, none if empty.
+  std::string shm_name; // Shared memory ring to publish into, none if empty.
+  int shm_every = 1;    // Publish every n-th step.
+  int shm_stride = 1;   // Publish every n-th ball.
+  int shm_max_balls = 0; // Balls of a frame, the capacity at start if 0.
+};
+
+void process_args(int argc, char **argv, Sim_Options &options);
@@ -18,5 +18,40 @@ typedef struct {
   float colors[3];
 } Ball;
 
-// Creates a random ball.
-Ball create_ball();
+// State of the simulation kept on the device, next to the balls.
+// Lets the number of balls change without the host reading it back.
+typedef struct {
+  int substep_balls;  // Balls stepped by the current sub-step, 0 past the last.
+  int num_balls;      // Live balls, stored first in the ball buffer.
+  int dropped_spawns; // Spawns beyond the capacity, never stored.
+  int num_substeps;   // Sub-steps of the current step.
+  float dt;           // Duration of a sub-step, the step being 1.
+  int step;           // Step being simulated.
+  int dropped_events; // Collision events beyond the capacity, never stored.
+  // BVH traversals that skipped a subtree, their stack being full: contacts
+  // or query hits may have been missed.
+  int stack_overflows;
+} Sim_State;
+
+// Ball state of the fixed-point mode (--fixed-point), 16 bytes against 40 for
+// Ball. Stepped with integer arithmetic only, so that every device computes
+// the same trajectories. Mass and colors stay in Ball.
+typedef struct {
+  int x;                 // In 2^-30 units: the box is [-2^30, 2^30].
+  int y;
+  short vx;              // In 2^-18 units per step, up to 0.125.
+  short vy;
+  unsigned short radius; // In 2^-19 units, up to 0.125.
+  short gravity;         // In 2^-18 units per step per step.
+} Fixed_Ball;
+
+// Distribution used to pick the radius of the spawned balls.
+enum class Radius_Dist {
+  fixed,    // Every ball has the largest radius.
+  mixed,    // Uniform pick among a few radii.
+  long_tail // Truncated power law: many small balls, a few large ones.
+};
+
+// Creates a random ball, drawn from gen.
+Ball create_ball(std::mt19937 &gen,
+                 Radius_Dist radius_dist = Radius_Dist::mixed);
@@ -1,9 +1,18 @@
 #pragma once
 #define CL_HPP_ENABLE_EXCEPTIONS
 #pragma OPENCL EXTENSION cl_intel_printf : enable
+#include "../include/args.hpp"
 #include "../include/ball.hpp"
+#include "../include/collision_events.hpp"
 #include "../include/display.hpp"
 #include "../include/kernel.hpp"
+#include "../include/launch_tuner.hpp"
+#include "../include/lbvh.hpp"
+#include "../include/prefix_sum.hpp"
+#include "../include/scene.hpp"
+#include "../include/snapshot.hpp"
+#include "../include/spatial_query.hpp"
+#include "../include/try_kernel.hpp"
 #include <CL/opencl.hpp>
 #include <GL/glew.h>
 #include <GL/glx.h>
@@ -16,7 +25,7 @@
 // Handles OpenCL and OpenGL interoperability.
 class CLGL_Manager {
 public:
-  CLGL_Manager(int num_balls, int num_vertices);
+  CLGL_Manager(const Sim_Options &options);
   ~CLGL_Manager();
 
   // Must be called first.
@@ -31,6 +40,27 @@ public:
   // OpenGL.
   void draw_balls();
 
+  // Draws the static obstacles of the scene, if any.
+  void draw_obstacles();
+
+  // Read-only copy of the ball state after the last update_balls().
+  // Does not block the command queue; check ready() or wait() before reading.
+  // Returns nullptr if too many snapshots are still held.
+  std::shared_ptr<const Ball_Snapshot> snapshot();
+
+  // Collisions of the past steps, read back without blocking.
+  Event_Stream &events() { return _events; }
+
+  // Balls the buffers have room for, grown as emitters spawn balls.
+  int capacity() const { return _capacity; }
+
+  // Runs a batch of queries against the balls after the last update_balls(),
+  // keeping at most max_hits hits overall, all of them read back. The BVH is
+  // rebuilt over them at the first batch of a step. Does not block the
+  // command queue; check ready() or wait() before reading.
+  std::shared_ptr<Query_Batch> query(const std::vector<Spatial_Query> &queries,
+                                     int max_hits = 1 << 12);
+
 private:
   cl::Platform _platform; // Only one platform needed.
   cl::Device _gpu_device;
@@ -38,13 +68,87 @@ private:
   cl::Context _context;
   cl::CommandQueue _queue;
   cl::Program _program;
-
-  const int _num_balls;
-  const int _num_vertices; // Num of vertices to display each ball.
+  bool _host_unified{false}; // Device memory is host memory.
+  size_t _local_size{256};    // Fixed local size, when the kernel needs one.
+  Launch_Tuner _tuner;        // Local size of the other kernels.
+  // Only the launches sure to do work are timed by the tuner: the first
+  // sub-step always runs, those after it may not.
+  bool _timed_launches{true};
+
+  // The live number of balls is only known on the device (Sim_State), as
+  // balls are spawned and removed there. The host keeps an upper bound of it,
+  // _max_balls, to size the kernel launches.
+  const int _initial_balls;
+  const int _max_capacity;   // Limit of the buffer growth.
+  const int _max_substeps;   // Sub-steps enqueued at each step.
+  const int _event_capacity; // Collision events recorded per step.
+  const Solver _solver;
+  const int _pbd_iterations;
+  const bool _fixed_point; // Steps Fixed_Ball copies of the balls.
+  const bool _tune;
+  const std::string _tune_dir;
+  int _capacity{0};          // Balls the buffers can hold.
+  int _max_balls{0};         // Upper bound of the live balls.
+  const int _num_vertices;   // Num of vertices to display each ball.
+  const Radius_Dist _radius_dist;
+  const std::string _scene_path;
+  std::mt19937 _rng; // Draws the balls, seeded for replays.
+  cl::Buffer _state_buffer; // Sim_State.
   cl::Buffer _balls_buffer;
+  cl_mem_flags _balls_flags{CL_MEM_READ_WRITE};
+  cl::Buffer _aabbs_buffer; // Bounding box of each ball, as float4.
+  // Position of each ball at the start of the sub-step, as float2.
+  cl::Buffer _starts_buffer;
+  LBVH _lbvh;               // Broad phase of the ball collisions.
+  // Position correction of each ball, for the PBD solver.
+  cl::Buffer _corrections_buffer;
+  // Fixed-point state of the balls, and the balls after their collisions,
+  // copied back into it.
+  cl::Buffer _fixed_buffer;
+  cl::Buffer _next_fixed_buffer;
+  // Step the float balls were last written back at, in fixed-point mode.
+  uint64_t _dequantized_step{~uint64_t(0)};
+  Snapshot_Pool _snapshots;
+  Event_Stream _events;
+  Spatial_Queries _queries;
+  // Step at the end of which the BVH was rebuilt for the queries.
+  uint64_t _queried_step{~uint64_t(0)};
+  uint64_t _step{0}; // Number of update_balls() calls.
   cl::BufferGL _vbo_cl;     // Use with OpenCL.
+  cl::BufferGL _colors_cl;  // Colors of the vertices, filled with vbo_cl.
   GLuint _vbos[2], _vao{0}; // VBO and VAO.
 
+  // Static obstacles, indexed by a uniform grid (see scene.hpp).
+  int _num_obstacles{0};
+  int _grid_size{1};
+  cl::Buffer _obstacles_buffer;
+  cl::Buffer _cell_start_buffer;
+  cl::Buffer _cell_items_buffer;
+  GLuint _obstacle_vbos[2], _obstacle_vao{0};
+  int _num_segment_vertices{0}; // Segments drawn as lines, first in the VBO.
+  int _num_pegs{0};             // Then pegs drawn as fans.
+
+  // Emitters, spawning balls appended on the device.
+  std::vector<Emitter> _emitters;
+  std::vector<float> _emit_credits; // Fraction of ball owed by each emitter.
+  std::vector<Ball> _new_balls[2];  // Uploaded every other step.
+  cl::Event _new_balls_written[2];
+  cl::Buffer _new_balls_buffer;
+
+  // Sinks, removing balls by compaction of the ball buffer.
+  int _num_sinks{0};
+  cl::Buffer _sinks_buffer;
+  cl::Buffer _kept_balls_buffer; // Compaction target, swapped with balls.
+  cl::Buffer _alive_buffer;      // 1 for each ball kept.
+  cl::Buffer _offsets_buffer;    // Prefix sum of _alive_buffer.
+  Prefix_Sum _prefix_sum;
+
+  // Asynchronous read of the live number of balls, to tighten _max_balls.
+  Sim_State _state_readback{};
+  cl::Event _state_read;
+  bool _state_read_pending{false};
+  int _spawned_since_read{0};
+
   // Init OpenGL.
   bool init_GLFW();
   bool init_GLEW();
@@ -57,15 +161,46 @@ private:
 
   GLFWwindow *create_window(int width, int height, const std::string &title);
 
-  // Create the buffer of vertices shared b/w OpenGL and OpenCL.
+  // Create the buffers of vertices and colors shared b/w OpenGL and OpenCL.
   void create_vbo();
 
+  // (Re)allocates every buffer sized by the capacity, but the balls.
+  void allocate_buffers();
+
+  // Grows the buffers geometrically to hold at least num_balls.
+  // Returns false if the capacity limit is reached.
+  bool reserve(int num_balls);
+
+  // Uploads the obstacles of the scene and their grid to the device.
+  void load_obstacles(const Scene &scene);
+
+  // Creates the static buffer of vertices of the obstacles.
+  void create_obstacle_vbo(const Scene &scene);
+
+  // Uploads the sinks and prepares the spawns of the emitters.
+  void load_emitters_and_sinks(const Scene &scene);
+
   // Given the current ball position, update the vertices stored in the vbo_cl.
   void update_vertices();
 
   // Print the vertices. For debugging only.
   void print_vertices();
 
+  // Appends the balls produced by the emitters.
+  void spawn_balls();
+
+  // Removes the balls inside sinks by stream compaction.
+  void despawn_balls();
+
+  // Lowers _max_balls from the live count, read without blocking.
+  void refresh_max_balls();
+
+  // Picks on the device the number of sub-steps of the step and their dt.
+  void plan_substeps();
+
+  // Starts the sub-step, or disables it past the planned number.
+  void begin_substep(int substep);
+
   // Updates coords based on speed.
   void update_pos();
 
@@ -73,10 +208,26 @@ private:
   // Also handles the gravity for the balls.
   void handle_wall_colls();
 
+  // Handles collisions with the static obstacles.
+  void handle_obstacle_colls();
+
+  // Rebuilds the BVH from the ball positions over the sub-step, or the
+  // current ones only if not swept.
+  void build_broad_phase(bool swept = true);
+
   // Handles collisions with balls.
   void handle_ball_colls();
-};
 
-// Tries to compile the kernel, and outputs error if .cl code is wrong.
-// Used this since I did not have a compiler for the kernel code.
-cl::Kernel try_kernel(cl::Program &prog, const std::string &fn_name);
\ No newline at end of file
+  // Position-based alternative to handle_ball_colls.
+  void solve_ball_contacts();
+
+  // Steps of the fixed-point mode, with the same roles as the float ones.
+  void quantize_balls();
+  // Writes the fixed-point state back to the float balls, once per step
+  // and only when they are read: drawn, copied or queried.
+  void dequantize_balls();
+  void plan_fixed_substeps();
+  void update_fixed_pos();
+  void handle_fixed_wall_colls();
+  void handle_fixed_ball_colls();
+};
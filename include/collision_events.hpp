@@ -0,0 +1,70 @@
+#pragma once
+#define CL_HPP_ENABLE_EXCEPTIONS
+#include "ball.hpp"
+#include "event_ring.hpp"
+#include <CL/opencl.hpp>
+#include <cstdint>
+#include <deque>
+#include <iostream>
+#include <vector>
+
+// Stream of the collisions recorded on the device.
+// The kernels of a step append their events to a batch buffer with an atomic
+// counter. At the end of the step, its count is read without blocking, then
+// the events themselves, and they end up in a host ring. Batches are reused
+// once drained.
+// Nothing ever waits: events past the capacity of a batch, or of a step with
+// no free batch, are dropped and counted on the device; events overwritten in
+// the full ring are counted on the host.
+class Event_Stream {
+public:
+  // Batches of capacity events each, a ring of ring_size events.
+  // A capacity of 0 disables the recording.
+  void init(cl::Context &context, int capacity, size_t ring_size,
+            int num_batches = 4);
+
+  // Kernel arguments for the current step.
+  // The capacity is -1 when disabled, 0 when every batch is still draining.
+  const cl::Buffer &events() const;
+  const cl::Buffer &count() const;
+  int capacity() const;
+
+  // Enqueues the read back of the step, moves to a free batch, and drains
+  // the reads completed so far. state holds the dropped events (Sim_State).
+  void end_step(cl::CommandQueue &queue, const cl::Buffer &state);
+
+  // Oldest event of the ring. Returns false if it is empty.
+  bool pop(Collision_Event &event);
+
+  // Events lost, on the device or in the ring.
+  uint64_t dropped() const {
+    return _device_dropped + _ring.overwritten();
+  }
+
+private:
+  struct Batch {
+    cl::Buffer events;
+    cl::Buffer count;
+    std::vector<Collision_Event> host_events;
+    cl_int host_count{0};
+    cl_int host_dropped{0}; // Sim_State::dropped_events after the step.
+    cl::Event count_read;
+    cl::Event events_read;
+    enum { idle, recording, counting, reading } stage{idle};
+  };
+
+  int _capacity{0};
+  cl::Buffer _unused; // Kernel argument when no batch is recording.
+  std::vector<Batch> _batches;
+  int _current{-1};         // Batch of the step, -1 if none is free.
+  std::deque<int> _pending; // Batches being read back, in step order.
+
+  Event_Ring _ring;
+  uint64_t _device_dropped{0};
+
+  // Moves on the pending batches whose reads completed. Never blocks.
+  void drain(cl::CommandQueue &queue);
+
+  // Picks the next free batch, if any.
+  void next_batch(cl::CommandQueue &queue);
+};
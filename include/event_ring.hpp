@@ -0,0 +1,42 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Walls, given as ball_b of a Collision_Event. Defined alike in the kernels.
+enum Wall { wall_bottom = -1, wall_top = -2, wall_left = -3, wall_right = -4 };
+
+// Collision recorded by the kernels.
+typedef struct {
+  int step;      // Step of the collision, counted on the device.
+  int ball_a;    // Index of the ball in the ball buffer at that step.
+  int ball_b;    // Other ball, or a Wall.
+  float impulse; // Magnitude of the change of momentum of ball_a.
+  float x;       // Contact point.
+  float y;
+} Collision_Event;
+
+// Host ring the collision events end up in, oldest first. Never grows: when
+// full, the oldest event is overwritten.
+class Event_Ring {
+public:
+  // Empties the ring, with room for size events.
+  void init(size_t size);
+
+  // Appends the event, overwriting the oldest one if full.
+  void push(const Collision_Event &event);
+
+  // Oldest event. Returns false if it is empty.
+  bool pop(Collision_Event &event);
+
+  size_t size() const { return _size; }
+
+  // Events lost, overwritten or pushed into a ring of no room.
+  uint64_t overwritten() const { return _overwritten; }
+
+private:
+  std::vector<Collision_Event> _events;
+  size_t _head{0};
+  size_t _size{0};
+  uint64_t _overwritten{0};
+};
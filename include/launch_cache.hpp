@@ -0,0 +1,15 @@
+#pragma once
+#include <cstddef>
+#include <map>
+#include <string>
+#include <utility>
+
+// Local sizes picked by Launch_Tuner, keyed by kernel name and bucket (log2
+// of the work-items). 0 lets the driver choose.
+using Launch_Sizes = std::map<std::pair<std::string, int>, size_t>;
+
+// Adds the sizes of the cache file at path. A missing file adds none.
+void load_launch_sizes(const std::string &path, Launch_Sizes &sizes);
+
+// Writes the sizes to the cache file at path. Returns false on errors.
+bool save_launch_sizes(const std::string &path, const Launch_Sizes &sizes);
@@ -0,0 +1,61 @@
+#pragma once
+#define CL_HPP_ENABLE_EXCEPTIONS
+#include "launch_cache.hpp"
+#include <CL/opencl.hpp>
+#include <iostream>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Picks the local size of the kernels launched over the balls.
+// While tuning, the first launches of a kernel for a given number of
+// work-items (rounded up to a power of two, the bucket) cycle through the
+// candidate local sizes, timed with profiling events read without blocking.
+// The candidate of lowest median time wins and is written to a cache file of
+// the device, loaded on later runs so that tuning only happens once.
+class Launch_Tuner {
+public:
+  // Loads the cache of the device from directory cache_dir.
+  // Without tuning, only cached sizes are used and the cache is not written.
+  // While tuning, the command queue must have profiling enabled.
+  void init(const cl::Device &device, const std::string &cache_dir,
+            bool tune);
+
+  bool tuning() const { return _tune; }
+
+  // Enqueues kernel over n work-items, rounded up to a multiple of the
+  // local size: kernels must ignore the extra work-items.
+  // Launches that may do no work, such as the sub-steps past the planned
+  // ones, are not timed: they would make any candidate look fastest.
+  void enqueue(cl::CommandQueue &queue, cl::Kernel &kernel,
+               const std::string &name, size_t n, bool timed = true);
+
+  // Collects the completed timings, and saves the cache when new sizes were
+  // picked. Never blocks.
+  void update();
+
+private:
+  // Timings of the candidates of a kernel and bucket.
+  struct Trial {
+    std::vector<size_t> candidates;         // 0 lets the driver choose.
+    std::vector<std::vector<double>> times; // Per candidate, in ns.
+    size_t next{0};                 // Candidate of the next launch.
+    std::vector<std::pair<cl::Event, size_t>> pending;
+  };
+
+  static constexpr size_t runs_per_candidate = 5;
+
+  cl::Device _device;
+  std::string _cache_path;
+  bool _tune{false};
+  bool _dirty{false}; // Picked sizes not saved yet.
+  Launch_Sizes _local_sizes;
+  std::map<std::pair<std::string, int>, Trial> _trials;
+
+  // Candidate local sizes supported by the kernel on the device.
+  std::vector<size_t> candidates(cl::Kernel &kernel) const;
+
+  void load();
+  void save() const;
+};
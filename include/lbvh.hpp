@@ -0,0 +1,47 @@
+#pragma once
+#define CL_HPP_ENABLE_EXCEPTIONS
+#include <CL/opencl.hpp>
+#include <iostream>
+
+// Linear BVH over a set of axis-aligned boxes, built on the device.
+// Rebuilt from scratch at every step (Karras 2012): Morton codes of the box
+// centers are sorted, the hierarchy is derived from the sorted codes, and the
+// node bounds are refit bottom-up. Handles boxes of widely different sizes,
+// unlike a uniform grid.
+//
+// Node layout (see the Node struct of the kernel source): the n - 1 internal
+// nodes come first, node 0 being the root, followed by the n leaves.
+// A leaf stores the index of its box in `left`.
+class LBVH {
+public:
+  // Allocates the device buffers for up to max_leaves boxes.
+  // The sort works in blocks of up to max_local_size, a power of two.
+  void init(cl::Context &context, cl::Program &program, int max_leaves,
+            size_t max_local_size = 256);
+
+  // Enqueues the build of the tree over the first boxes of aabbs, as many as
+  // the int at the start of leaf_count, read on the device. max_leaves is an
+  // upper bound of it known on the host. Nothing is built, at the cost of the
+  // launches only, when the leaf count is 0.
+  // Boxes are float4 values (min_x, min_y, max_x, max_y).
+  void build(cl::CommandQueue &queue, const cl::Buffer &aabbs,
+             const cl::Buffer &leaf_count, int max_leaves);
+
+  // Buffer of Node, to be traversed by kernels.
+  const cl::Buffer &nodes() const { return _nodes; }
+
+private:
+  cl::Program _program;
+  int _max_leaves{0};
+  size_t _max_local_size{256};
+
+  cl::Buffer _keys;  // Morton codes.
+  cl::Buffer _ids;   // Box indices, sorted along the keys.
+  cl::Buffer _nodes; // Internal nodes followed by the leaves.
+  cl::Buffer _flags; // Visit counters of the internal nodes for the refit.
+
+  // Sorts the first size (a power of two) _keys and _ids by increasing key
+  // (bitonic sort).
+  void sort(cl::CommandQueue &queue, const cl::Buffer &leaf_count,
+            size_t size);
+};
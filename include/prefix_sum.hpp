@@ -0,0 +1,27 @@
+#pragma once
+#define CL_HPP_ENABLE_EXCEPTIONS
+#include <CL/opencl.hpp>
+#include <iostream>
+#include <vector>
+
+// Parallel exclusive prefix sum of int buffers, on the device.
+// Each work-group scans a block in local memory, the block totals are
+// scanned recursively, then added back to their block.
+class Prefix_Sum {
+public:
+  // Allocates the block totals for buffers of up to max_size elements.
+  void init(cl::Context &context, cl::Program &program, int max_size,
+            size_t block_size = 256);
+
+  // Enqueues the in-place exclusive prefix sum of the first size elements.
+  void scan(cl::CommandQueue &queue, const cl::Buffer &data, int size);
+
+private:
+  cl::Program _program;
+  size_t _block_size{256};
+  // Block totals of each recursion level.
+  std::vector<cl::Buffer> _block_sums;
+
+  void scan_level(cl::CommandQueue &queue, const cl::Buffer &data, int size,
+                  size_t level);
+};
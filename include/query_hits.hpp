@@ -0,0 +1,36 @@
+#pragma once
+#include <cstddef>
+
+// Ball found by a query.
+typedef struct {
+  int ball;       // Index of the ball in the ball buffer.
+  float x;        // Center of the ball.
+  float y;
+  float distance; // From the query center, 0 for rectangles.
+} Query_Hit;
+
+// Hits of a batch of queries, as read back from the device: query q counted
+// counts[q] hits and stored them from offsets[q] on, the exclusive prefix sum
+// of the counts. Hits past max_hits were dropped. Does not own the arrays.
+class Query_Hits {
+public:
+  Query_Hits() = default;
+  Query_Hits(const int *counts, const int *offsets, const Query_Hit *hits,
+             int num_queries, int max_hits);
+
+  // Hits counted over the batch, stored or not.
+  int total() const;
+
+  // Stored hits of the query, the first ones it counted.
+  int num_hits(size_t query) const;
+  const Query_Hit *hits(size_t query) const;
+
+  bool truncated() const { return total() > _max_hits; }
+
+private:
+  const int *_counts{nullptr};
+  const int *_offsets{nullptr};
+  const Query_Hit *_hits{nullptr};
+  int _num_queries{0};
+  int _max_hits{0};
+};
@@ -0,0 +1,58 @@
+#pragma once
+#include <string>
+#include <vector>
+
+// Static obstacle, a capsule: every point within radius of the segment from
+// (x0, y0) to (x1, y1). Pegs are zero length capsules, walls zero radius.
+// Written in C to be compatible with OpenCL, like Ball.
+typedef struct {
+  float x0;
+  float y0;
+  float x1;
+  float y1;
+  float radius;
+} Obstacle;
+
+// Spawns rate balls per step (can be fractional) around (x, y).
+struct Emitter {
+  float x;
+  float y;
+  float rate;
+};
+
+// Removes the balls whose center enters the rectangle.
+// Same layout as an OpenCL float4.
+struct Sink {
+  float min_x;
+  float min_y;
+  float max_x;
+  float max_y;
+};
+
+// Static geometry of the simulation, loaded from a scene file.
+//
+// One element per line, coordinates in the [-1, 1] box, '#' starts a comment:
+//   peg x y radius
+//   segment x0 y0 x1 y1
+//   polygon x0 y0 x1 y1 x2 y2 ...   (closed, at least 3 vertices)
+//   emitter x y rate
+//   sink x0 y0 x1 y1
+struct Scene {
+  std::vector<Obstacle> obstacles;
+  std::vector<Emitter> emitters;
+  std::vector<Sink> sinks;
+};
+
+// Reads the scene file. Exits on errors.
+Scene load_scene(const std::string &path);
+
+// Uniform grid over the [-1, 1] box indexing the obstacles, built once.
+// Stored as compressed rows: the obstacles of cell c are
+// items[cell_start[c]] to items[cell_start[c + 1] - 1].
+struct Obstacle_Grid {
+  int size{1}; // Cells per side.
+  std::vector<int> cell_start;
+  std::vector<int> items;
+};
+
+Obstacle_Grid build_obstacle_grid(const std::vector<Obstacle> &obstacles);
@@ -0,0 +1,32 @@
+#pragma once
+#include "clgl_manager.hpp"
+#include "shm_writer.hpp"
+#include <deque>
+#include <memory>
+#include <string>
+
+// Publishes the ball state into a POSIX shared memory ring (see shm_ring.hpp)
+// for external consumer processes. Never waits on the device nor on the
+// readers: snapshots are taken asynchronously and written once they land.
+class Shm_Publisher {
+public:
+  // Creates the ring of the given name ("/name"), with room for max_balls:
+  // frames of more balls are cut short. A ring left by an earlier run is
+  // reset. Every every-th step is published, keeping every stride-th ball.
+  Shm_Publisher(const std::string &name, int max_balls, int every = 1,
+                int stride = 1, int num_slots = 8);
+  Shm_Publisher(const Shm_Publisher &) = delete;
+  Shm_Publisher &operator=(const Shm_Publisher &) = delete;
+
+  // To be called once per step, after update_balls().
+  void update(CLGL_Manager &prog);
+
+private:
+  const int _every;
+  const int _stride;
+  Shm_Writer _writer;
+  uint64_t _num_steps{0};
+  // Snapshots taken but not published yet, oldest first. Released before
+  // the ring is removed.
+  std::deque<std::shared_ptr<const Ball_Snapshot>> _pending;
+};
@@ -0,0 +1,48 @@
+#pragma once
+#include "shm_ring.hpp"
+#include <string>
+#include <vector>
+
+// Frame of the ring, read in place in the shared memory.
+struct Shm_Frame_View {
+  uint64_t frame{0};
+  uint64_t step{0};
+  uint32_t num_balls{0};
+  uint32_t stride{1};
+  const Ball *balls{nullptr};
+};
+
+// Attaches to the ring published by the simulator (see shm_ring.hpp).
+// Lock-free and wait-free towards the publisher: a frame overwritten while
+// it is being read is reported as invalid and must be dropped.
+class Shm_Reader {
+public:
+  Shm_Reader() = default;
+  ~Shm_Reader();
+  Shm_Reader(const Shm_Reader &) = delete;
+  Shm_Reader &operator=(const Shm_Reader &) = delete;
+
+  // Maps the ring of the given name. Returns false if it does not exist.
+  bool open(const std::string &name);
+
+  // Zero-copy view of the newest complete frame not seen yet.
+  // Returns false if there is none. The data must be checked with validate()
+  // once read.
+  bool acquire(Shm_Frame_View &view);
+
+  // True if the frame of the view was not overwritten since acquire().
+  bool validate(const Shm_Frame_View &view) const;
+
+  // Copies the newest frame not seen yet into balls.
+  // Returns false if there is none or it was overwritten during the copy.
+  bool read(Shm_Frame_View &view, std::vector<Ball> &balls);
+
+  // Frames published but never acquired, because the reader was too slow.
+  uint64_t skipped() const { return _skipped; }
+
+private:
+  Shm_Header *_header{nullptr};
+  size_t _size{0};
+  uint64_t _next_frame{0}; // First frame not seen yet.
+  uint64_t _skipped{0};
+};
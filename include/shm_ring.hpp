@@ -0,0 +1,60 @@
+#pragma once
+#include "ball.hpp"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Layout of the shared memory ring the simulator publishes the ball state
+// into, shared by the publisher and the readers.
+//
+//   Shm_Header | Shm_Slot 0 + balls | Shm_Slot 1 + balls | ...
+//
+// Frame f is written in slot f % num_slots. Each slot is a seqlock: its seq
+// is odd while the publisher writes it, then 2 * f + 2 once frame f is
+// complete. Readers never block the publisher: they check seq before and
+// after reading, and a reader too slow to keep up simply skips frames.
+
+static constexpr uint32_t shm_magic = 0x42414c4c; // "BALL".
+static constexpr uint32_t shm_version = 1;
+
+struct Shm_Header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t num_slots;
+  uint32_t max_balls;        // Capacity of a slot.
+  uint64_t slot_size;        // Bytes, Shm_Slot and its balls.
+  std::atomic<uint64_t> head; // Number of complete frames published.
+};
+
+struct Shm_Slot {
+  std::atomic<uint64_t> seq;
+  uint64_t step;      // Simulation step of the frame.
+  uint32_t num_balls; // Balls in the frame.
+  uint32_t stride;    // Frame holds every stride-th ball of the simulation.
+  // Followed by num_balls Ball.
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "The shared memory ring needs lock-free 64-bit atomics.");
+
+// Bytes of a slot holding up to max_balls, aligned for the next slot.
+inline size_t shm_slot_size(uint32_t max_balls) {
+  const size_t size = sizeof(Shm_Slot) + max_balls * sizeof(Ball);
+  return (size + 63) / 64 * 64;
+}
+
+inline size_t shm_segment_size(uint32_t num_slots, uint32_t max_balls) {
+  return (sizeof(Shm_Header) + 63) / 64 * 64 +
+         num_slots * shm_slot_size(max_balls);
+}
+
+// Slot of index i in the segment starting at header.
+inline Shm_Slot *shm_slot(Shm_Header *header, uint32_t i) {
+  char *first = reinterpret_cast<char *>(header) +
+                (sizeof(Shm_Header) + 63) / 64 * 64;
+  return reinterpret_cast<Shm_Slot *>(first + i * header->slot_size);
+}
+
+inline Ball *shm_slot_balls(Shm_Slot *slot) {
+  return reinterpret_cast<Ball *>(slot + 1);
+}
@@ -0,0 +1,25 @@
+#pragma once
+#include "shm_ring.hpp"
+#include <string>
+
+// Writer side of the shared memory ring (see shm_ring.hpp), which it creates
+// and removes. Never waits on the readers.
+class Shm_Writer {
+public:
+  // Creates the ring of the given name ("/name"), with slots of max_balls.
+  // A ring left by an earlier run is reset. Exits on errors.
+  Shm_Writer(const std::string &name, uint32_t max_balls,
+             uint32_t num_slots = 8);
+  ~Shm_Writer();
+  Shm_Writer(const Shm_Writer &) = delete;
+  Shm_Writer &operator=(const Shm_Writer &) = delete;
+
+  // Writes every stride-th of the balls as the next frame, cut short past
+  // the capacity of a slot.
+  void write(uint64_t step, const Ball *balls, int num_balls, int stride = 1);
+
+private:
+  const std::string _name;
+  Shm_Header *_header{nullptr};
+  size_t _size{0};
+};
@@ -0,0 +1,74 @@
+#pragma once
+#define CL_HPP_ENABLE_EXCEPTIONS
+#include "ball.hpp"
+#include <CL/opencl.hpp>
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+// Host-visible staging buffer a snapshot is copied into.
+// A CL_MEM_ALLOC_HOST_PTR buffer mapped for its whole life: pinned memory on
+// discrete GPUs, so the copy is a plain DMA, and the very memory the device
+// works in on CPU devices and integrated GPUs, where the copy is a memcpy
+// with no driver staging.
+struct Snapshot_Slot {
+  Snapshot_Slot(cl::Context &context, cl::CommandQueue &queue, int max_balls);
+  ~Snapshot_Slot();
+
+  cl::CommandQueue queue; // Used to unmap the buffer.
+  cl::Buffer staging;
+  Ball *mapped{nullptr};
+  Sim_State state{}; // Copied along with the balls.
+  std::atomic<bool> in_use{false};
+};
+
+// Read-only copy of the ball state at a given step.
+// Filled by the device asynchronously: taking a snapshot never blocks the
+// command queue, only reading it before it is ready does.
+class Ball_Snapshot {
+public:
+  // True once the copy has completed. Never blocks.
+  bool ready() const;
+
+  // Blocks until the copy has completed.
+  void wait() const;
+
+  // Valid once ready.
+  const Ball *balls() const { return _slot->mapped; }
+  int num_balls() const { return std::min(_slot->state.num_balls, _copied); }
+  uint64_t step() const { return _step; }
+  // Counters of the device, such as the dropped spawns and events.
+  const Sim_State &state() const { return _slot->state; }
+  // Hash of the positions and speeds, to compare runs (FNV-1a).
+  uint64_t digest() const;
+
+private:
+  friend class Snapshot_Pool;
+
+  std::shared_ptr<Snapshot_Slot> _slot;
+  int _copied{0}; // Balls copied, an upper bound of the live ones.
+  uint64_t _step{0};
+  cl::Event _done;
+};
+
+// Staging slots the snapshots are copied into, reused once released.
+class Snapshot_Pool {
+public:
+  // Slots of max_balls balls each. Can be called again to resize the slots,
+  // snapshots still held keep their old slot.
+  void init(cl::Context &context, cl::CommandQueue &queue, int max_balls,
+            int num_slots = 3);
+
+  // Enqueues a non-blocking copy of the live balls, at most max_balls.
+  // state holds their number (Sim_State).
+  // Returns nullptr when every slot is still held by a snapshot: the caller
+  // should skip this step.
+  std::shared_ptr<const Ball_Snapshot>
+  take(cl::CommandQueue &queue, const cl::Buffer &balls,
+       const cl::Buffer &state, int max_balls, uint64_t step);
+
+private:
+  std::vector<std::shared_ptr<Snapshot_Slot>> _slots;
+};
@@ -0,0 +1,111 @@
+#pragma once
+#define CL_HPP_ENABLE_EXCEPTIONS
+#include "prefix_sum.hpp"
+#include "query_hits.hpp"
+#include <CL/opencl.hpp>
+#include <atomic>
+#include <cfloat>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+// Kinds of Spatial_Query.
+enum Query_Type { query_circle = 0, query_rect = 1, query_nearest = 2 };
+
+// Query run on the device against the BVH of the balls.
+// Uploaded as is: query_kernel_source() declares the same fields.
+typedef struct {
+  int type;     // Query_Type.
+  int k;        // Nearest balls wanted, at most 32 (query_nearest).
+  float x;      // Center, or lower corner of the rectangle.
+  float y;
+  float max_x;  // Upper corner of the rectangle (query_rect).
+  float max_y;
+  float radius; // Search radius (query_circle, query_nearest).
+} Spatial_Query;
+
+// Balls whose center is within radius of (x, y).
+Spatial_Query circle_query(float x, float y, float radius);
+
+// Balls whose center is inside the rectangle.
+Spatial_Query rect_query(float min_x, float min_y, float max_x, float max_y);
+
+// The k balls whose center is nearest (x, y), sorted by distance, only
+// counting those within max_distance.
+Spatial_Query nearest_query(float x, float y, int k,
+                            float max_distance = FLT_MAX);
+
+// Device buffers of a batch and the host arrays they are read back into,
+// sized for max_queries queries and max_hits hits. Reused once released.
+struct Query_Slot {
+  int max_queries{0};
+  int max_hits{0};
+  cl::Buffer queries_buffer;
+  cl::Buffer counts_buffer;
+  cl::Buffer offsets_buffer;
+  cl::Buffer hits_buffer;
+  std::vector<Spatial_Query> queries; // Kept alive until written.
+  std::vector<cl_int> counts;
+  std::vector<cl_int> offsets;
+  std::vector<Query_Hit> hits;
+  std::atomic<bool> in_use{false};
+};
+
+// Hits of a batch of queries, read back from the device.
+// The hits of each query are stored contiguously: their number is counted
+// first, and the prefix sum of the counts gives where each query writes.
+// Every read-back is enqueued with the kernels, after the pass storing the
+// hits, so nothing blocks until wait() and nothing is enqueued later.
+class Query_Batch {
+public:
+  // True once the hits are read back. Never blocks.
+  bool ready() const;
+
+  // Blocks until the hits are read back.
+  void wait() const;
+
+  // Valid once ready.
+  size_t num_queries() const { return _num_queries; }
+  int num_hits(size_t query) const { return stored().num_hits(query); }
+  const Query_Hit *hits(size_t query) const { return stored().hits(query); }
+  // Hits lost past the capacity of the batch.
+  bool truncated() const { return stored().truncated(); }
+
+private:
+  friend class Spatial_Queries;
+
+  Query_Hits stored() const;
+
+  std::shared_ptr<Query_Slot> _slot;
+  int _num_queries{0};
+  int _max_hits{0};
+  cl::Event _done; // None if nothing was enqueued.
+};
+
+// Runs batches of queries in a single kernel launch per pass, against the
+// BVH of the balls: no ball is copied to the host and no query scans them
+// all.
+class Spatial_Queries {
+public:
+  void init(cl::Context &context, cl::Program &program,
+            size_t block_size = 256);
+
+  // Enqueues the queries against the balls and their BVH (see lbvh.hpp).
+  // The leaf count of the BVH is the first field of state (Sim_State).
+  // At most max_hits hits are kept over the whole batch, all read back.
+  // The batch holds a slot of the pool until released.
+  std::shared_ptr<Query_Batch> run(cl::CommandQueue &queue,
+                                   const std::vector<Spatial_Query> &queries,
+                                   int max_hits, const cl::Buffer &balls,
+                                   const cl::Buffer &nodes,
+                                   const cl::Buffer &state);
+
+private:
+  cl::Context _context;
+  cl::Program _program;
+  size_t _block_size{256};
+  Prefix_Sum _prefix_sum;
+  int _max_queries{0}; // Largest batch the prefix sum is sized for.
+  // Grown when every slot is held by a batch.
+  std::vector<std::shared_ptr<Query_Slot>> _slots;
+};
@@ -0,0 +1,9 @@
+#pragma once
+#define CL_HPP_ENABLE_EXCEPTIONS
+#include <CL/opencl.hpp>
+#include <iostream>
+#include <string>
+
+// Tries to compile the kernel, and outputs error if .cl code is wrong.
+// Used this since I did not have a compiler for the kernel code.
+cl::Kernel try_kernel(cl::Program &prog, const std::string &fn_name);
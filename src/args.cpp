@@ -1,37 +1,114 @@
 #include "../include/args.hpp"
+#include <algorithm>
 #include <cstdlib>
 
-void process_args(int argc, char **argv, int &num_balls, int &num_vertices) {
+// Returns the value following the flag at argv[i], exits if there is none.
+static std::string flag_value(int argc, char **argv, int &i) {
+  if (i + 1 < argc)
+    return argv[++i];
+  std::cerr << "Error: " << argv[i] << " flag requires a value." << std::endl;
+  exit(EXIT_FAILURE);
+}
 
-  num_balls = 0;
-  num_vertices = 0;
+void process_args(int argc, char **argv, Sim_Options &options) {
 
   for (int i = 1; i < argc; i++) {
     std::string arg = argv[i];
 
     if (arg == "-b" || arg == "--balls") {
-      if (i + 1 < argc)
-        num_balls = std::stoi(argv[++i]);
+      options.num_balls = std::stoi(flag_value(argc, argv, i));
+    } else if (arg == "--max-balls") {
+      options.max_balls = std::stoi(flag_value(argc, argv, i));
+    } else if (arg == "--max-substeps") {
+      options.max_substeps = std::stoi(flag_value(argc, argv, i));
+    } else if (arg == "--events") {
+      options.event_capacity = std::stoi(flag_value(argc, argv, i));
+    } else if (arg == "-v" || arg == "--vertices") {
+      options.num_vertices = std::stoi(flag_value(argc, argv, i));
+    } else if (arg == "-r" || arg == "--radii") {
+      const std::string dist = flag_value(argc, argv, i);
+      if (dist == "fixed")
+        options.radius_dist = Radius_Dist::fixed;
+      else if (dist == "mixed")
+        options.radius_dist = Radius_Dist::mixed;
+      else if (dist == "longtail")
+        options.radius_dist = Radius_Dist::long_tail;
       else {
-        std::cerr << "Error: --balls flag requires a value." << std::endl;
+        std::cerr << dist << ": Unknown radius distribution." << std::endl;
         exit(EXIT_FAILURE);
       }
-    } else if (arg == "-v" || arg == "--vertices") {
-      if (i + 1 < argc)
-        num_vertices = std::stoi(argv[++i]);
+    } else if (arg == "--solver") {
+      const std::string solver = flag_value(argc, argv, i);
+      if (solver == "impulse")
+        options.solver = Solver::impulse;
+      else if (solver == "pbd")
+        options.solver = Solver::pbd;
       else {
-        std::cerr << "Error: --vertices flag requires a value." << std::endl;
+        std::cerr << solver << ": Unknown solver." << std::endl;
+        exit(EXIT_FAILURE);
+      }
+    } else if (arg == "--pbd-iters") {
+      options.pbd_iterations = std::stoi(flag_value(argc, argv, i));
+    } else if (arg == "--fixed-point") {
+      options.fixed_point = true;
+    } else if (arg == "--seed") {
+      options.seed = std::stoi(flag_value(argc, argv, i));
+    } else if (arg == "--digest") {
+      options.digest_every = std::stoi(flag_value(argc, argv, i));
+    } else if (arg == "--no-tune") {
+      options.tune = false;
+    } else if (arg == "--tune-dir") {
+      options.tune_dir = flag_value(argc, argv, i);
+    } else if (arg == "-s" || arg == "--scene") {
+      options.scene_path = flag_value(argc, argv, i);
+    } else if (arg == "--shm") {
+      options.shm_name = flag_value(argc, argv, i);
+      if (options.shm_name.empty()) {
+        std::cerr << "Error: " << arg << " flag requires a name." << std::endl;
         exit(EXIT_FAILURE);
       }
+      if (options.shm_name.front() != '/')
+        options.shm_name.insert(0, "/");
+    } else if (arg == "--shm-every") {
+      options.shm_every = std::stoi(flag_value(argc, argv, i));
+    } else if (arg == "--shm-stride") {
+      options.shm_stride = std::stoi(flag_value(argc, argv, i));
+    } else if (arg == "--shm-max-balls") {
+      options.shm_max_balls = std::stoi(flag_value(argc, argv, i));
     } else {
       std::cerr << argv[i] << ": Unknown argument." << std::endl;
       exit(EXIT_FAILURE);
     }
   }
 
-  // Defaults args.
-  if (num_balls == 0)
-    num_balls = 5;
-  if (num_vertices == 0)
-    num_vertices = 40;
-}
\ No newline at end of file
+  if (options.num_balls < 0 || options.num_vertices <= 2) {
+    std::cerr << "Error: need a non-negative number of balls and at least 3 "
+                 "vertices."
+              << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  if (options.max_substeps < 1 || options.pbd_iterations < 1) {
+    std::cerr << "Error: need at least 1 sub-step and 1 iteration."
+              << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  options.max_balls = std::max(options.max_balls, options.num_balls);
+
+  // Features with float kernels only, they would break the determinism of
+  // the fixed-point mode.
+  if (options.fixed_point) {
+    if (!options.scene_path.empty())
+      std::cerr << "Warning: the scene is ignored with --fixed-point."
+                << std::endl;
+    if (options.solver == Solver::pbd)
+      std::cerr << "Warning: --solver pbd is ignored with --fixed-point."
+                << std::endl;
+    if (options.event_capacity > 0)
+      std::cerr << "Warning: no collision events are recorded with "
+                   "--fixed-point."
+                << std::endl;
+    options.scene_path.clear();
+    options.solver = Solver::impulse;
+    options.event_capacity = 0;
+  }
+}
@@ -1,6 +1,7 @@
 #include "../include/ball.hpp"
+#include <cmath>
 
-Ball create_ball() {
+Ball create_ball(std::mt19937 &gen, Radius_Dist radius_dist) {
   static constexpr float max_coord =
       0.85f; // Do not want ball spawning on borders: Creates a bug.
   static constexpr float max_speed = 0.040f;
@@ -8,9 +9,10 @@ Ball create_ball() {
   static constexpr float min_grav = -0.002f;
   static constexpr float color_range = 1.0f;
   static constexpr std::array<float, 3> radii = {0.025, 0.050, 0.075};
-
-  std::random_device rd;  // Obtain a random number from hardware
-  std::mt19937 gen(rd()); // Seed the generator
+  // Bounds and exponent of the long tail distribution.
+  static constexpr float min_radius = 0.005f;
+  static constexpr float max_radius = 0.100f;
+  static constexpr float tail_exponent = 2.5f;
 
   // Generates random coordinate values.
   static std::uniform_real_distribution<float> coord_value(-max_coord,
@@ -31,9 +33,25 @@ Ball create_ball() {
   static std::uniform_real_distribution<float> gravity_value(min_grav, -0.001);
 
   // Returns a random radius.
-  auto radius_value = [&gen]() -> float {
-    std::uniform_int_distribution<> index_value(0, radii.size() - 1);
-    return radii[index_value(gen)];
+  auto radius_value = [&gen, radius_dist]() -> float {
+    switch (radius_dist) {
+    case Radius_Dist::fixed:
+      return radii.back();
+    case Radius_Dist::long_tail: {
+      // Inverse CDF of a Pareto distribution truncated to
+      // [min_radius, max_radius].
+      std::uniform_real_distribution<float> u_value(0.0f, 1.0f);
+      const float u = u_value(gen);
+      const float lo = std::pow(min_radius, -tail_exponent);
+      const float hi = std::pow(max_radius, -tail_exponent);
+      return std::pow(lo - u * (lo - hi), -1.0f / tail_exponent);
+    }
+    case Radius_Dist::mixed:
+    default: {
+      std::uniform_int_distribution<> index_value(0, radii.size() - 1);
+      return radii[index_value(gen)];
+    }
+    }
   };
 
   // Generate random colors.
@@ -51,8 +69,8 @@ Ball create_ball() {
   ball.y = coord_value(gen);
   ball.vx = velocity_value();
   ball.vy = velocity_value();
-  // ball.radius = radius_value();
-  ball.radius = 0.075;
+  // Mass proportional to the area of the ball.
+  ball.mass = ball.radius * ball.radius;
   ball.gravity = gravity_value(gen);
 
   return ball;
@@ -1,8 +1,16 @@
 #include "../include/clgl_manager.hpp"
 #include <CL/cl_platform.h>
 
-CLGL_Manager::CLGL_Manager(int num_balls, int num_vertices)
-    : _num_balls(num_balls), _num_vertices(num_vertices) {}
+CLGL_Manager::CLGL_Manager(const Sim_Options &options)
+    : _initial_balls(options.num_balls), _max_capacity(options.max_balls),
+      _max_substeps(options.max_substeps),
+      _event_capacity(options.event_capacity), _solver(options.solver),
+      _pbd_iterations(options.pbd_iterations),
+      _fixed_point(options.fixed_point), _tune(options.tune),
+      _tune_dir(options.tune_dir),
+      _num_vertices(options.num_vertices),
+      _radius_dist(options.radius_dist), _scene_path(options.scene_path),
+      _rng(options.seed >= 0 ? options.seed : std::random_device{}()) {}
 
 CLGL_Manager::~CLGL_Manager() { glfwTerminate(); }
 
@@ -14,20 +22,64 @@ GLFWwindow *CLGL_Manager::init(int width, int height) {
 
   // Initializes OpenCL.
   init_opencl();
+  init_program(kernel_source());
+
+  // The kernels working in blocks of local memory share _local_size: it
+  // must suit each of them, not only the device.
+  for (const char *name :
+       {"plan_substeps", "plan_fixed_substeps", "bitonic_sort_local",
+        "scan_blocks", "add_block_sums"}) {
+    cl::Kernel kernel = try_kernel(_program, name);
+    size_t max_size = _local_size;
+    kernel.getWorkGroupInfo(_gpu_device, CL_KERNEL_WORK_GROUP_SIZE,
+                            &max_size);
+    while (_local_size > max_size)
+      _local_size /= 2;
+  }
 
   // Create the balls.
+  // Room for some spawns before the first growth.
+  _capacity = std::min(std::max(_initial_balls, 64), _max_capacity);
+  _max_balls = _initial_balls;
   std::vector<Ball> balls;
-  balls.reserve(_num_balls);
-  std::generate_n(std::back_inserter(balls), _num_balls, create_ball);
+  balls.reserve(_capacity);
+  std::generate_n(std::back_inserter(balls), _initial_balls,
+                  [this]() { return create_ball(_rng, _radius_dist); });
+  balls.resize(_capacity);
 
   // Create the buffer of balls on device.
-  _balls_buffer = cl::Buffer(_context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
-                             _num_balls * sizeof(Ball), balls.data());
+  // Allocated in host memory when the device works in it anyway, so that
+  // snapshots of the state are plain memory copies.
+  _balls_flags = CL_MEM_READ_WRITE;
+  if (_host_unified)
+    _balls_flags |= CL_MEM_ALLOC_HOST_PTR;
+  _balls_buffer =
+      cl::Buffer(_context, _balls_flags | CL_MEM_COPY_HOST_PTR,
+                 _capacity * sizeof(Ball), balls.data());
+  Sim_State state{0, _initial_balls, 0, 1, 1.0f, 0, 0, 0};
+  _state_buffer =
+      cl::Buffer(_context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                 sizeof(Sim_State), &state);
+
+  // Collisions read back by the host, if asked for.
+  _events.init(_context, _event_capacity, 16 * _event_capacity);
+  _queries.init(_context, _program, _local_size);
+
+  // Static obstacles, emitters and sinks.
+  if (!_scene_path.empty()) {
+    const Scene scene = load_scene(_scene_path);
+    load_obstacles(scene);
+    create_obstacle_vbo(scene);
+    load_emitters_and_sinks(scene);
+  }
 
   // Create the vertices buffer shared by OpenCL and OpenGL.
   create_vbo();
 
-  init_program(kernel_source());
+  // Every other buffer sized by the capacity.
+  allocate_buffers();
+  if (_fixed_point)
+    quantize_balls();
 
   // Create shader program to display circles.
   GLuint program =
@@ -95,6 +147,13 @@ void CLGL_Manager::init_opencl() {
   _gpu_device.getInfo(CL_DEVICE_MAX_WORK_GROUP_SIZE, &max_work_group_size);
   std::cout << "The GPU device has a maximum work group size of: "
             << max_work_group_size << std::endl;
+  // Largest power of two allowed, up to 256, for the kernels working in
+  // blocks of local memory.
+  while (_local_size > max_work_group_size)
+    _local_size /= 2;
+  cl_bool host_unified = CL_FALSE;
+  _gpu_device.getInfo(CL_DEVICE_HOST_UNIFIED_MEMORY, &host_unified);
+  _host_unified = host_unified == CL_TRUE;
 
   // Needed to get Interoperability b/w OpenGL and OpenCL.
   cl_context_properties properties[] = {
@@ -108,7 +167,10 @@ void CLGL_Manager::init_opencl() {
   _context = cl::Context(_gpu_device, properties);
 
   // Create Command Queue.
-  _queue = cl::CommandQueue(_context, _gpu_device);
+  // Profiling times the launches while tuning.
+  _queue = cl::CommandQueue(_context, _gpu_device,
+                            _tune ? CL_QUEUE_PROFILING_ENABLE : 0);
+  _tuner.init(_gpu_device, _tune_dir, _tune);
 }
 
 void CLGL_Manager::init_program(const std::string &kernel_source) {
@@ -134,45 +196,18 @@ void CLGL_Manager::create_vbo() {
   glBindBuffer(GL_ARRAY_BUFFER,
                _vbos[0]); // Bind the buffer to the GL_ARRAY_BUFFER target.
 
-  // Allocates memory for each vertex of each ball.
-  // Each vertex has 6 components, the RGB colors and (x,y,z).
-  glBufferData(GL_ARRAY_BUFFER, sizeof(cl_float3) * _num_vertices * _num_balls,
-               nullptr, GL_DYNAMIC_DRAW);
-
   // Layout specified.
   // Three components (x, y, z) per attribute.
   glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(cl_float3),
                         (GLvoid *)0);
   glEnableVertexAttribArray(0); // Enables position attribute to be rendered.
 
-  // Get colors stored in GPU.
-  std::vector<Ball> host_balls(_num_balls);
-  // host_balls.reserve(_num_balls);
-  _queue.enqueueReadBuffer(_balls_buffer, CL_TRUE, 0, _num_balls * sizeof(Ball),
-                           host_balls.data());
-
-  // Get a one-dimension array of colors from all the balls.
-  // Colors will be structured as such: [R0, G0, B0, R1, G1, B1, ...].
-  auto get_colors = [&host_balls, this]() {
-    std::vector<float> colors;                      // Array of colors.
-    colors.reserve(3 * _num_balls * _num_vertices); // RGB for each vertex.
-    for (const Ball &ball : host_balls) {
-      const auto ball_colors = ball.colors;
-      // One single color for all vertices of a Ball.
-      for (int j = 0; j < _num_vertices; j++) {
-        colors.emplace_back(ball_colors[0]);
-        colors.emplace_back(ball_colors[1]);
-        colors.emplace_back(ball_colors[2]);
-      }
-    }
-    return colors;
-  };
-
   // Generate and bind the color VBO.
+  // Filled by compute_ball_vertices along with the positions, as balls are
+  // spawned and moved around in the buffer on the device.
+  // Colors will be structured as such: [R0, G0, B0, R1, G1, B1, ...].
   glGenBuffers(1, &_vbos[1]);
   glBindBuffer(GL_ARRAY_BUFFER, _vbos[1]);
-  glBufferData(GL_ARRAY_BUFFER, 3 * sizeof(float) * _num_balls * _num_vertices,
-               get_colors().data(), GL_STATIC_DRAW);
   // Setting up the RGB.
   // Stored in an different VBO, not interleaved with positions.
   glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float),
@@ -183,37 +218,208 @@ void CLGL_Manager::create_vbo() {
   glBindVertexArray(0);
   // Unbind the VBO.
   glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void CLGL_Manager::allocate_buffers() {
+  // Broad phase structures.
+  _aabbs_buffer = cl::Buffer(_context, CL_MEM_READ_WRITE,
+                             _capacity * sizeof(cl_float4));
+  _starts_buffer = cl::Buffer(_context, CL_MEM_READ_WRITE,
+                              _capacity * sizeof(cl_float2));
+  _lbvh.init(_context, _program, _capacity, _local_size);
+  if (_solver == Solver::pbd)
+    _corrections_buffer = cl::Buffer(_context, CL_MEM_READ_WRITE,
+                                     _capacity * sizeof(cl_float2));
+  _snapshots.init(_context, _queue, _capacity);
+  // Without emitters, the capacity never grows in fixed-point mode: the
+  // state is not lost here.
+  if (_fixed_point) {
+    _fixed_buffer = cl::Buffer(_context, CL_MEM_READ_WRITE,
+                               _capacity * sizeof(Fixed_Ball));
+    _next_fixed_buffer = cl::Buffer(_context, CL_MEM_READ_WRITE,
+                                    _capacity * sizeof(Fixed_Ball));
+  }
+
+  // Compaction of the balls.
+  if (_num_sinks > 0) {
+    _kept_balls_buffer =
+        cl::Buffer(_context, _balls_flags, _capacity * sizeof(Ball));
+    _alive_buffer =
+        cl::Buffer(_context, CL_MEM_READ_WRITE, _capacity * sizeof(int));
+    _offsets_buffer =
+        cl::Buffer(_context, CL_MEM_READ_WRITE, _capacity * sizeof(int));
+    _prefix_sum.init(_context, _program, _capacity, _local_size);
+  }
+
+  // The OpenCL side must be released before OpenGL reallocates the buffers.
+  _vbo_cl = cl::BufferGL();
+  _colors_cl = cl::BufferGL();
+
+  // Allocates memory for each vertex of each ball.
+  // Each vertex has 6 components, the RGB colors and (x,y,z).
+  glBindBuffer(GL_ARRAY_BUFFER, _vbos[0]);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(cl_float3) * _num_vertices * _capacity,
+               nullptr, GL_DYNAMIC_DRAW);
+  glBindBuffer(GL_ARRAY_BUFFER, _vbos[1]);
+  glBufferData(GL_ARRAY_BUFFER, 3 * sizeof(float) * _capacity * _num_vertices,
+               nullptr, GL_DYNAMIC_DRAW);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
 
   try {
     // Creates and assign our vertex buffer.
     // Size is defined by the underlying OpenGL buffer.
     _vbo_cl = cl::BufferGL(_context, CL_MEM_READ_WRITE, _vbos[0]);
+    _colors_cl = cl::BufferGL(_context, CL_MEM_WRITE_ONLY, _vbos[1]);
   } catch (const cl::Error &e) {
     std::cerr << "OpenCL Error: " << e.what() << " (" << e.err() << ")"
               << std::endl;
   }
 }
 
-void CLGL_Manager::update_vertices() {
-  static cl::Kernel kernel = try_kernel(_program, "compute_ball_vertices");
-  kernel.setArg(0, _balls_buffer);
-  kernel.setArg(1, _vbo_cl);
-  kernel.setArg(2, _num_balls);
-  kernel.setArg(3, _num_vertices);
+bool CLGL_Manager::reserve(int num_balls) {
+  if (num_balls <= _capacity)
+    return true;
+  if (_capacity == _max_capacity)
+    return false;
+
+  // Geometric growth, so this stays rare.
+  const int capacity =
+      std::min(std::max(num_balls, 2 * _capacity), _max_capacity);
+  std::cout << "Growing the ball capacity to " << capacity << std::endl;
 
-  //_queue.enqueueAcquireGLObjects(&_vbo_cl);
   try {
-    _queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(_num_balls));
+    // The device must be done with the old buffers.
+    _queue.finish();
+    cl::Buffer balls(_context, _balls_flags, capacity * sizeof(Ball));
+    _queue.enqueueCopyBuffer(_balls_buffer, balls, 0, 0,
+                             _capacity * sizeof(Ball));
+    _balls_buffer = balls;
   } catch (const cl::Error &e) {
     std::cerr << "OpenCL Error: " << e.what() << " (" << e.err() << ")"
               << std::endl;
+    return false;
   }
+
+  _capacity = capacity;
+  allocate_buffers();
+  return num_balls <= _capacity;
+}
+
+void CLGL_Manager::load_obstacles(const Scene &scene) {
+  _num_obstacles = scene.obstacles.size();
+  if (_num_obstacles == 0)
+    return;
+
+  const Obstacle_Grid grid = build_obstacle_grid(scene.obstacles);
+  _grid_size = grid.size;
+  std::cout << "Obstacle grid of " << grid.size << "x" << grid.size
+            << " cells, " << grid.items.size() << " entries." << std::endl;
+
+  // Never empty, an empty buffer is invalid.
+  std::vector<int> items = grid.items;
+  if (items.empty())
+    items.push_back(0);
+
+  auto obstacles = scene.obstacles;
+  auto cell_start = grid.cell_start;
+  const cl_mem_flags flags = CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR;
+  _obstacles_buffer =
+      cl::Buffer(_context, flags, obstacles.size() * sizeof(Obstacle),
+                 obstacles.data());
+  _cell_start_buffer = cl::Buffer(
+      _context, flags, cell_start.size() * sizeof(int), cell_start.data());
+  _cell_items_buffer =
+      cl::Buffer(_context, flags, items.size() * sizeof(int), items.data());
+}
+
+void CLGL_Manager::create_obstacle_vbo(const Scene &scene) {
+  // (x, y, z) of the segments as lines, then of the pegs as fans.
+  std::vector<float> positions;
+  for (const Obstacle &obstacle : scene.obstacles) {
+    if (obstacle.radius == 0.0f) {
+      positions.insert(positions.end(), {obstacle.x0, obstacle.y0, 1.0f,
+                                         obstacle.x1, obstacle.y1, 1.0f});
+      _num_segment_vertices += 2;
+    }
+  }
+  for (const Obstacle &obstacle : scene.obstacles) {
+    if (obstacle.radius == 0.0f)
+      continue;
+    // Same layout as the balls, see compute_ball_vertices.
+    positions.insert(positions.end(), {obstacle.x0, obstacle.y0, 1.0f});
+    for (int i = 0; i < (_num_vertices - 1); i++) {
+      const float theta = (float)i / (_num_vertices - 2) * 6.28318f;
+      positions.insert(positions.end(),
+                       {obstacle.x0 + obstacle.radius * std::cos(theta),
+                        obstacle.y0 + obstacle.radius * std::sin(theta), 1.0f});
+    }
+    _num_pegs++;
+  }
+  // Light grey.
+  const std::vector<float> colors(positions.size(), 0.8f);
+
+  glGenVertexArrays(1, &_obstacle_vao);
+  glBindVertexArray(_obstacle_vao);
+
+  glGenBuffers(2, _obstacle_vbos);
+  glBindBuffer(GL_ARRAY_BUFFER, _obstacle_vbos[0]);
+  glBufferData(GL_ARRAY_BUFFER, positions.size() * sizeof(float),
+               positions.data(), GL_STATIC_DRAW);
+  glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float),
+                        (GLvoid *)0);
+  glEnableVertexAttribArray(0);
+
+  glBindBuffer(GL_ARRAY_BUFFER, _obstacle_vbos[1]);
+  glBufferData(GL_ARRAY_BUFFER, colors.size() * sizeof(float), colors.data(),
+               GL_STATIC_DRAW);
+  glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float),
+                        (GLvoid *)0);
+  glEnableVertexAttribArray(1);
+
+  glBindVertexArray(0);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void CLGL_Manager::load_emitters_and_sinks(const Scene &scene) {
+  _emitters = scene.emitters;
+  _emit_credits.assign(_emitters.size(), 0.0f);
+  // Most balls spawned in a single step.
+  int max_new_balls = 0;
+  for (const Emitter &emitter : _emitters)
+    max_new_balls += static_cast<int>(std::ceil(emitter.rate));
+  if (max_new_balls > 0)
+    _new_balls_buffer = cl::Buffer(_context, CL_MEM_READ_ONLY,
+                                   max_new_balls * sizeof(Ball));
+
+  _num_sinks = scene.sinks.size();
+  if (_num_sinks > 0) {
+    auto sinks = scene.sinks;
+    _sinks_buffer =
+        cl::Buffer(_context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                   sinks.size() * sizeof(Sink), sinks.data());
+  }
+}
+
+void CLGL_Manager::update_vertices() {
+  if (_max_balls == 0)
+    return;
+  dequantize_balls();
+  static cl::Kernel kernel = try_kernel(_program, "compute_ball_vertices");
+  kernel.setArg(0, _balls_buffer);
+  kernel.setArg(1, _vbo_cl);
+  kernel.setArg(2, _colors_cl);
+  kernel.setArg(3, _state_buffer);
+  kernel.setArg(4, _num_vertices);
+  kernel.setArg(5, _max_balls);
+
+  //_queue.enqueueAcquireGLObjects(&_vbo_cl);
+  _tuner.enqueue(_queue, kernel, "compute_ball_vertices", _max_balls);
 }
 
 void CLGL_Manager::print_vertices() {
   static cl::Kernel kernel = try_kernel(_program, "print_vertices");
   kernel.setArg(0, _vbo_cl);
-  kernel.setArg(1, _num_balls);
+  kernel.setArg(1, _max_balls);
   kernel.setArg(2, _num_vertices);
 
   // Num of work items is dependent on num_balls.
@@ -225,72 +431,403 @@ void CLGL_Manager::print_vertices() {
   }
 }
 
-void CLGL_Manager::update_pos() {
-  // Should be only created once.
-  static cl::Kernel kernel = try_kernel(_program, "update_pos");
-  kernel.setArg(0, _balls_buffer); // Updates balls on GPU.
-  kernel.setArg(1, _num_balls);
+void CLGL_Manager::spawn_balls() {
+  if (_emitters.empty())
+    return;
+  static cl::Kernel kernel = try_kernel(_program, "spawn_balls");
+  // Spawned balls do not start on top of each other.
+  static std::uniform_real_distribution<float> jitter(-0.02f, 0.02f);
+
+  // Host copy reused every other step, once its last upload is done.
+  std::vector<Ball> &new_balls = _new_balls[_step % 2];
+  cl::Event &written = _new_balls_written[_step % 2];
+  if (written())
+    written.wait();
+
+  new_balls.clear();
+  for (size_t i = 0; i < _emitters.size(); i++) {
+    _emit_credits[i] += _emitters[i].rate;
+    for (; _emit_credits[i] >= 1.0f; _emit_credits[i] -= 1.0f) {
+      Ball ball = create_ball(_rng, _radius_dist);
+      ball.x = _emitters[i].x + jitter(_rng);
+      ball.y = _emitters[i].y + jitter(_rng);
+      new_balls.push_back(ball);
+    }
+  }
+  if (new_balls.empty())
+    return;
+
+  // Grows up to the --max-balls limit. Past it, every spawn still goes to
+  // the device, which stores those that fit the live balls and counts the
+  // others as dropped: _max_balls is only an upper bound of them.
+  reserve(_max_balls + new_balls.size());
+  const int num_new = new_balls.size();
+
+  kernel.setArg(0, _balls_buffer);
+  kernel.setArg(1, _new_balls_buffer);
+  kernel.setArg(2, num_new);
+  kernel.setArg(3, _state_buffer);
+  kernel.setArg(4, _capacity);
 
-  // Num of work items is dependent on num_balls.
   try {
-    _queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(_num_balls));
+    _queue.enqueueWriteBuffer(_new_balls_buffer, CL_FALSE, 0,
+                              num_new * sizeof(Ball), new_balls.data(),
+                              nullptr, &written);
   } catch (const cl::Error &e) {
     std::cerr << "OpenCL Error: " << e.what() << " (" << e.err() << ")"
               << std::endl;
+    return;
   }
+  _tuner.enqueue(_queue, kernel, "spawn_balls", num_new);
+  _max_balls = std::min(_max_balls + num_new, _capacity);
+  _spawned_since_read += num_new;
 }
 
-void CLGL_Manager::handle_wall_colls() {
-  static cl::Kernel kernel = try_kernel(_program, "handle_wall_colls");
+void CLGL_Manager::despawn_balls() {
+  if (_num_sinks == 0)
+    return;
+  static cl::Kernel mark = try_kernel(_program, "mark_alive");
+  static cl::Kernel compact = try_kernel(_program, "compact_balls");
+
+  mark.setArg(0, _balls_buffer);
+  mark.setArg(1, _sinks_buffer);
+  mark.setArg(2, _num_sinks);
+  mark.setArg(3, _state_buffer);
+  mark.setArg(4, _alive_buffer);
+  mark.setArg(5, _offsets_buffer);
+  mark.setArg(6, _max_balls);
+
+  compact.setArg(0, _balls_buffer);
+  compact.setArg(1, _kept_balls_buffer);
+  compact.setArg(2, _alive_buffer);
+  compact.setArg(3, _offsets_buffer);
+  compact.setArg(4, _state_buffer);
+  compact.setArg(5, _max_balls);
+
+  // Kept balls are moved, in order, to the other buffer, which becomes the
+  // ball buffer.
+  _tuner.enqueue(_queue, mark, "mark_alive", _max_balls);
+  _prefix_sum.scan(_queue, _offsets_buffer, _max_balls);
+  _tuner.enqueue(_queue, compact, "compact_balls", _max_balls);
+  std::swap(_balls_buffer, _kept_balls_buffer);
+}
+
+void CLGL_Manager::refresh_max_balls() {
+  if (_state_read_pending) {
+    if (_state_read.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() !=
+        CL_COMPLETE)
+      return;
+    _state_read_pending = false;
+    _max_balls = std::min(_max_balls,
+                          _state_readback.num_balls + _spawned_since_read);
+  }
+
+  // Only matters when balls are removed, no need to do it at every step.
+  if (_num_sinks == 0 || _step % 16 != 0)
+    return;
+  try {
+    _queue.enqueueReadBuffer(_state_buffer, CL_FALSE, 0, sizeof(Sim_State),
+                             &_state_readback, nullptr, &_state_read);
+    _state_read_pending = true;
+    _spawned_since_read = 0;
+  } catch (const cl::Error &e) {
+    std::cerr << "OpenCL Error: " << e.what() << " (" << e.err() << ")"
+              << std::endl;
+  }
+}
+
+void CLGL_Manager::plan_substeps() {
+  static cl::Kernel kernel = try_kernel(_program, "plan_substeps");
+  const size_t local_size = _local_size;
   kernel.setArg(0, _balls_buffer);
-  kernel.setArg(1, _num_balls);
+  kernel.setArg(1, _state_buffer);
+  kernel.setArg(2, static_cast<int>(_step));
+  kernel.setArg(3, _max_substeps);
+  kernel.setArg(4, _num_obstacles);
+  kernel.setArg(5, cl::Local(local_size * sizeof(float)));
+  kernel.setArg(6, cl::Local(local_size * sizeof(float)));
+
+  // A single work-group reduces over all the balls.
+  try {
+    _queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(local_size),
+                                cl::NDRange(local_size));
+  } catch (const cl::Error &e) {
+    std::cerr << "OpenCL Error: " << e.what() << " (" << e.err() << ")"
+              << std::endl;
+  }
+}
+
+void CLGL_Manager::begin_substep(int substep) {
+  static cl::Kernel kernel = try_kernel(_program, "begin_substep");
+  kernel.setArg(0, _state_buffer);
+  kernel.setArg(1, substep);
 
   try {
-    // 4 Work-items allocated per ball.
-    _queue.enqueueNDRangeKernel(kernel, cl::NullRange,
-                                cl::NDRange(_num_balls * 4), cl::NDRange(4));
+    _queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(1));
   } catch (const cl::Error &e) {
     std::cerr << "OpenCL Error: " << e.what() << " (" << e.err() << ")"
               << std::endl;
   }
 }
 
+void CLGL_Manager::update_pos() {
+  // Should be only created once.
+  static cl::Kernel kernel = try_kernel(_program, "update_pos");
+  kernel.setArg(0, _balls_buffer); // Updates balls on GPU.
+  kernel.setArg(1, _starts_buffer);
+  kernel.setArg(2, _state_buffer);
+
+  // Num of work items is dependent on num_balls.
+  _tuner.enqueue(_queue, kernel, "update_pos", _max_balls,
+                 _timed_launches);
+}
+
+void CLGL_Manager::handle_wall_colls() {
+  static cl::Kernel kernel = try_kernel(_program, "handle_wall_colls");
+  kernel.setArg(0, _balls_buffer);
+  kernel.setArg(1, _state_buffer);
+  kernel.setArg(2, _events.events());
+  kernel.setArg(3, _events.count());
+  kernel.setArg(4, _events.capacity());
+
+  // 4 Work-items allocated per ball.
+  _tuner.enqueue(_queue, kernel, "handle_wall_colls", _max_balls * 4,
+                 _timed_launches);
+}
+
+void CLGL_Manager::handle_obstacle_colls() {
+  if (_num_obstacles == 0)
+    return;
+
+  static cl::Kernel kernel = try_kernel(_program, "handle_obstacle_colls");
+  kernel.setArg(0, _balls_buffer);
+  kernel.setArg(1, _obstacles_buffer);
+  kernel.setArg(2, _cell_start_buffer);
+  kernel.setArg(3, _cell_items_buffer);
+  kernel.setArg(4, _grid_size);
+  kernel.setArg(5, _state_buffer);
+
+  _tuner.enqueue(_queue, kernel, "handle_obstacle_colls", _max_balls,
+                 _timed_launches);
+}
+
+void CLGL_Manager::build_broad_phase(bool swept) {
+  if (_fixed_point) {
+    static cl::Kernel kernel = try_kernel(_program, "compute_fixed_aabbs");
+    kernel.setArg(0, _fixed_buffer);
+    kernel.setArg(1, _aabbs_buffer);
+    kernel.setArg(2, _state_buffer);
+    _tuner.enqueue(_queue, kernel, "compute_fixed_aabbs", _max_balls,
+                   _timed_launches);
+  } else {
+    static cl::Kernel kernel = try_kernel(_program, "compute_ball_aabbs");
+    kernel.setArg(0, _balls_buffer);
+    kernel.setArg(1, _starts_buffer);
+    kernel.setArg(2, _aabbs_buffer);
+    kernel.setArg(3, _state_buffer);
+    // The position-based solver moves the balls after the build: their
+    // boxes are grown so that new contacts are still found.
+    kernel.setArg(4, _solver == Solver::pbd ? 0.25f : 0.0f);
+    kernel.setArg(5, swept ? 1 : 0);
+    _tuner.enqueue(_queue, kernel, "compute_ball_aabbs", _max_balls,
+                   _timed_launches);
+  }
+  // The leaf count is the first field of Sim_State: the balls of the
+  // sub-step.
+  _lbvh.build(_queue, _aabbs_buffer, _state_buffer, _max_balls);
+}
+
 void CLGL_Manager::handle_ball_colls() {
   static cl::Kernel kernel = try_kernel(_program, "handle_ball_colls");
   kernel.setArg(0, _balls_buffer);
-  kernel.setArg(1, _num_balls);
+  kernel.setArg(1, _starts_buffer);
+  kernel.setArg(2, _lbvh.nodes());
+  kernel.setArg(3, _state_buffer);
+  kernel.setArg(4, _events.events());
+  kernel.setArg(5, _events.count());
+  kernel.setArg(6, _events.capacity());
+
+  _tuner.enqueue(_queue, kernel, "handle_ball_colls", _max_balls,
+                 _timed_launches);
+}
+
+void CLGL_Manager::solve_ball_contacts() {
+  static cl::Kernel solve = try_kernel(_program, "pbd_solve_contacts");
+  static cl::Kernel apply = try_kernel(_program, "pbd_apply_corrections");
+
+  solve.setArg(0, _balls_buffer);
+  solve.setArg(1, _lbvh.nodes());
+  solve.setArg(2, _state_buffer);
+  solve.setArg(3, _corrections_buffer);
+  apply.setArg(0, _balls_buffer);
+  apply.setArg(1, _corrections_buffer);
+  apply.setArg(2, _state_buffer);
+
+  // The corrections of every ball are gathered, then applied.
+  for (int i = 0; i < _pbd_iterations; i++) {
+    _tuner.enqueue(_queue, solve, "pbd_solve_contacts", _max_balls,
+                   _timed_launches);
+    _tuner.enqueue(_queue, apply, "pbd_apply_corrections", _max_balls,
+                   _timed_launches);
+  }
+}
+
+void CLGL_Manager::quantize_balls() {
+  static cl::Kernel kernel = try_kernel(_program, "quantize_balls");
+  kernel.setArg(0, _balls_buffer);
+  kernel.setArg(1, _fixed_buffer);
+  kernel.setArg(2, _state_buffer);
+
+  _tuner.enqueue(_queue, kernel, "quantize_balls", _max_balls);
+}
+
+void CLGL_Manager::dequantize_balls() {
+  if (!_fixed_point || _dequantized_step == _step)
+    return;
+  _dequantized_step = _step;
+  static cl::Kernel kernel = try_kernel(_program, "dequantize_balls");
+  kernel.setArg(0, _fixed_buffer);
+  kernel.setArg(1, _balls_buffer);
+  kernel.setArg(2, _state_buffer);
+
+  _tuner.enqueue(_queue, kernel, "dequantize_balls", _max_balls);
+}
+
+void CLGL_Manager::plan_fixed_substeps() {
+  static cl::Kernel kernel = try_kernel(_program, "plan_fixed_substeps");
+  const size_t local_size = _local_size;
+  kernel.setArg(0, _fixed_buffer);
+  kernel.setArg(1, _state_buffer);
+  kernel.setArg(2, static_cast<int>(_step));
+  kernel.setArg(3, _max_substeps);
+  kernel.setArg(4, cl::Local(local_size * sizeof(int)));
+  kernel.setArg(5, cl::Local(local_size * sizeof(int)));
+
   try {
-    _queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(_num_balls),
-                                cl::NDRange(1));
+    _queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(local_size),
+                                cl::NDRange(local_size));
   } catch (const cl::Error &e) {
     std::cerr << "OpenCL Error: " << e.what() << " (" << e.err() << ")"
               << std::endl;
   }
 }
 
+void CLGL_Manager::update_fixed_pos() {
+  static cl::Kernel kernel = try_kernel(_program, "update_fixed_pos");
+  kernel.setArg(0, _fixed_buffer);
+  kernel.setArg(1, _state_buffer);
+
+  _tuner.enqueue(_queue, kernel, "update_fixed_pos", _max_balls,
+                 _timed_launches);
+}
+
+void CLGL_Manager::handle_fixed_wall_colls() {
+  static cl::Kernel kernel = try_kernel(_program, "handle_fixed_wall_colls");
+  kernel.setArg(0, _fixed_buffer);
+  kernel.setArg(1, _state_buffer);
+
+  _tuner.enqueue(_queue, kernel, "handle_fixed_wall_colls", _max_balls,
+                 _timed_launches);
+}
+
+void CLGL_Manager::handle_fixed_ball_colls() {
+  static cl::Kernel kernel = try_kernel(_program, "handle_fixed_ball_colls");
+  static cl::Kernel apply = try_kernel(_program, "apply_fixed_ball_colls");
+  kernel.setArg(0, _fixed_buffer);
+  kernel.setArg(1, _next_fixed_buffer);
+  kernel.setArg(2, _lbvh.nodes());
+  kernel.setArg(3, _state_buffer);
+  apply.setArg(0, _next_fixed_buffer);
+  apply.setArg(1, _fixed_buffer);
+  apply.setArg(2, _state_buffer);
+
+  _tuner.enqueue(_queue, kernel, "handle_fixed_ball_colls", _max_balls,
+                 _timed_launches);
+  _tuner.enqueue(_queue, apply, "apply_fixed_ball_colls", _max_balls,
+                 _timed_launches);
+}
+
 void CLGL_Manager::update_balls() {
-  update_pos();
-  handle_wall_colls();
-  handle_ball_colls();
+  spawn_balls();
+  if (_max_balls > 0 && _fixed_point) {
+    plan_fixed_substeps();
+    for (int substep = 0; substep < _max_substeps; substep++) {
+      _timed_launches = substep == 0;
+      begin_substep(substep);
+      update_fixed_pos();
+      handle_fixed_wall_colls();
+      build_broad_phase();
+      handle_fixed_ball_colls();
+    }
+  } else if (_max_balls > 0) {
+    plan_substeps();
+    // The number of sub-steps is only known on the device: every sub-step up
+    // to the max is enqueued, those not needed doing nothing.
+    for (int substep = 0; substep < _max_substeps; substep++) {
+      _timed_launches = substep == 0;
+      begin_substep(substep);
+      update_pos();
+      handle_wall_colls();
+      handle_obstacle_colls();
+      build_broad_phase();
+      if (_solver == Solver::pbd)
+        solve_ball_contacts();
+      else
+        handle_ball_colls();
+    }
+    despawn_balls();
+  }
+  _timed_launches = true;
+  _events.end_step(_queue, _state_buffer);
+  _tuner.update();
+  refresh_max_balls();
+  _step++;
+}
+
+std::shared_ptr<const Ball_Snapshot> CLGL_Manager::snapshot() {
+  dequantize_balls();
+  return _snapshots.take(_queue, _balls_buffer, _state_buffer, _max_balls,
+                         _step);
+}
+
+std::shared_ptr<Query_Batch>
+CLGL_Manager::query(const std::vector<Spatial_Query> &queries, int max_hits) {
+  // The BVH of the last sub-step is stale: the balls moved since, and sinks
+  // may have compacted them.
+  dequantize_balls();
+  if (_queried_step != _step) {
+    // Not timed: kept apart from the builds of the steps.
+    _timed_launches = false;
+    begin_substep(0);
+    // Around the current positions: the start positions of the last
+    // sub-step are stale once sinks compacted the balls.
+    if (_max_balls > 0)
+      build_broad_phase(false);
+    _timed_launches = true;
+    _queried_step = _step;
+  }
+  return _queries.run(_queue, queries, max_hits, _balls_buffer, _lbvh.nodes(),
+                      _state_buffer);
 }
 
 void CLGL_Manager::draw_balls() {
   update_vertices();
   glBindVertexArray(_vao); // Get the binded VBO and vertex attrib.
   // print_vertices();
-  for (int i = 0; i < _num_balls; i++)
+  // Removed balls are drawn with no radius.
+  for (int i = 0; i < _max_balls; i++)
     glDrawArrays(GL_TRIANGLE_FAN, _num_vertices * i, _num_vertices);
   glBindVertexArray(0);
 }
 
-cl::Kernel try_kernel(cl::Program &prog, const std::string &fn_name) {
-  cl::Kernel kernel;
-  try {
-    kernel = cl::Kernel(prog, fn_name);
-  } catch (const cl::Error &e) {
-    std::cerr << "OpenCL Error: " << e.what() << " (" << e.err() << ")"
-              << std::endl;
-    exit(1);
-  }
-  return kernel;
-}
\ No newline at end of file
+void CLGL_Manager::draw_obstacles() {
+  if (_obstacle_vao == 0)
+    return;
+
+  glBindVertexArray(_obstacle_vao);
+  glDrawArrays(GL_LINES, 0, _num_segment_vertices);
+  for (int i = 0; i < _num_pegs; i++)
+    glDrawArrays(GL_TRIANGLE_FAN, _num_segment_vertices + _num_vertices * i,
+                 _num_vertices);
+  glBindVertexArray(0);
+}
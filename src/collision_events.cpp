@@ -0,0 +1,130 @@
+#include "../include/collision_events.hpp"
+#include <algorithm>
+#include <cstddef>
+
+void Event_Stream::init(cl::Context &context, int capacity, size_t ring_size,
+                        int num_batches) {
+  _capacity = capacity;
+  _batches.clear();
+  _pending.clear();
+  _ring.init(ring_size);
+
+  try {
+    _unused = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(Collision_Event));
+    if (_capacity <= 0)
+      return;
+
+    _batches.resize(num_batches);
+    cl_int zero = 0;
+    for (Batch &batch : _batches) {
+      batch.events = cl::Buffer(context, CL_MEM_READ_WRITE,
+                                _capacity * sizeof(Collision_Event));
+      batch.count =
+          cl::Buffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                     sizeof(cl_int), &zero);
+      batch.host_events.resize(_capacity);
+    }
+  } catch (const cl::Error &e) {
+    std::cerr << "OpenCL Error: " << e.what() << " (" << e.err() << ")"
+              << std::endl;
+    _capacity = 0;
+    _batches.clear();
+    return;
+  }
+
+  // Counts start at 0, the first batch records right away.
+  _current = 0;
+  _batches[0].stage = Batch::recording;
+}
+
+const cl::Buffer &Event_Stream::events() const {
+  return _current < 0 ? _unused : _batches[_current].events;
+}
+
+const cl::Buffer &Event_Stream::count() const {
+  return _current < 0 ? _unused : _batches[_current].count;
+}
+
+int Event_Stream::capacity() const {
+  if (_capacity <= 0)
+    return -1;
+  return _current < 0 ? 0 : _capacity;
+}
+
+void Event_Stream::end_step(cl::CommandQueue &queue, const cl::Buffer &state) {
+  if (_capacity <= 0)
+    return;
+
+  try {
+    if (_current >= 0) {
+      Batch &batch = _batches[_current];
+      queue.enqueueReadBuffer(batch.count, CL_FALSE, 0, sizeof(cl_int),
+                              &batch.host_count);
+      queue.enqueueReadBuffer(state, CL_FALSE,
+                              offsetof(Sim_State, dropped_events),
+                              sizeof(cl_int), &batch.host_dropped, nullptr,
+                              &batch.count_read);
+      batch.stage = Batch::counting;
+      _pending.push_back(_current);
+    }
+    drain(queue);
+    next_batch(queue);
+    // Starts the reads without waiting for the next step.
+    queue.flush();
+  } catch (const cl::Error &e) {
+    std::cerr << "OpenCL Error: " << e.what() << " (" << e.err() << ")"
+              << std::endl;
+  }
+}
+
+void Event_Stream::drain(cl::CommandQueue &queue) {
+  while (!_pending.empty()) {
+    Batch &batch = _batches[_pending.front()];
+
+    if (batch.stage == Batch::counting) {
+      if (batch.count_read.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() !=
+          CL_COMPLETE)
+        return;
+      _device_dropped =
+          std::max<uint64_t>(_device_dropped, batch.host_dropped);
+      const int num_events = std::min(batch.host_count, _capacity);
+      if (num_events > 0) {
+        queue.enqueueReadBuffer(batch.events, CL_FALSE, 0,
+                                num_events * sizeof(Collision_Event),
+                                batch.host_events.data(), nullptr,
+                                &batch.events_read);
+        batch.host_count = num_events;
+        batch.stage = Batch::reading;
+        // Read in order: the next batches wait for this one.
+        return;
+      }
+    } else if (batch.stage == Batch::reading) {
+      if (batch.events_read.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() !=
+          CL_COMPLETE)
+        return;
+      for (int i = 0; i < batch.host_count; i++)
+        _ring.push(batch.host_events[i]);
+    }
+
+    batch.stage = Batch::idle;
+    _pending.pop_front();
+  }
+}
+
+void Event_Stream::next_batch(cl::CommandQueue &queue) {
+  const int num_batches = _batches.size();
+  const int first = _current + 1;
+  _current = -1;
+  for (int i = 0; i < num_batches && _current < 0; i++)
+    if (_batches[(first + i) % num_batches].stage == Batch::idle)
+      _current = (first + i) % num_batches;
+  // Else the step records nothing, its events are counted as dropped.
+  if (_current < 0)
+    return;
+
+  _batches[_current].stage = Batch::recording;
+  queue.enqueueFillBuffer(_batches[_current].count, cl_int(0), 0,
+                          sizeof(cl_int));
+}
+
+bool Event_Stream::pop(Collision_Event &event) { return _ring.pop(event); }
@@ -0,0 +1,31 @@
+#include "../include/event_ring.hpp"
+
+void Event_Ring::init(size_t size) {
+  _events.assign(size, Collision_Event{});
+  _head = _size = 0;
+  _overwritten = 0;
+}
+
+void Event_Ring::push(const Collision_Event &event) {
+  if (_events.empty()) {
+    _overwritten++;
+    return;
+  }
+  if (_size == _events.size()) {
+    // Full: the oldest event is lost.
+    _head = (_head + 1) % _events.size();
+    _size--;
+    _overwritten++;
+  }
+  _events[(_head + _size) % _events.size()] = event;
+  _size++;
+}
+
+bool Event_Ring::pop(Collision_Event &event) {
+  if (_size == 0)
+    return false;
+  event = _events[_head];
+  _head = (_head + 1) % _events.size();
+  _size--;
+  return true;
+}
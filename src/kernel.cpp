@@ -2,7 +2,310 @@
 
 // tbb pipeline with ball program.
 
-const std::string kernel_source() {
+// Kernels building the linear BVH of the broad phase. See lbvh.hpp.
+static const std::string lbvh_kernel_source() {
+  return R(
+      typedef struct {
+        float min_x;
+        float min_y;
+        float max_x;
+        float max_y;
+        int left;  // Left child, or box index for a leaf.
+        int right; // Right child, unused for a leaf.
+        int parent;
+        int padding;
+      } Node;
+
+      // Spreads the lower 16 bits of v on the even bits.
+      uint expand_bits(uint v) {
+        v &= 0x0000ffff;
+        v = (v | (v << 8)) & 0x00ff00ff;
+        v = (v | (v << 4)) & 0x0f0f0f0f;
+        v = (v | (v << 2)) & 0x33333333;
+        v = (v | (v << 1)) & 0x55555555;
+        return v;
+      }
+
+      // One Morton code per box center. The padding up to the power of two
+      // size of the sort gets the largest key so it ends up last.
+      // Builds over no leaves are skipped altogether, down to the sort.
+      __kernel void compute_morton_codes(__global const float4 *aabbs,
+                                         __global uint *keys,
+                                         __global int *ids,
+                                         __global const int *leaf_count) {
+        const int num_leaves = *leaf_count;
+        const int id = get_global_id(0);
+        if (num_leaves == 0)
+          return;
+        ids[id] = id;
+
+        if (id >= num_leaves) {
+          keys[id] = 0xffffffff;
+          return;
+        }
+
+        const float4 box = aabbs[id];
+        // Center mapped from the [-1, 1] box to [0, 65534].
+        const float cx = clamp((box.x + box.z) * 0.25f + 0.5f, 0.0f, 1.0f);
+        const float cy = clamp((box.y + box.w) * 0.25f + 0.5f, 0.0f, 1.0f);
+        const uint qx = (uint)(cx * 65534.0f);
+        const uint qy = (uint)(cy * 65534.0f);
+        keys[id] = (expand_bits(qx) << 1) | expand_bits(qy);
+      }
+
+      // Compares keys[i] and keys[l] and swaps them if needed, given the
+      // direction of the bitonic sequence of size k holding i.
+      void bitonic_compare(uint *key_i, int *id_i, uint *key_l, int *id_l,
+                           const uint i, const uint k) {
+        const bool ascending = (i & k) == 0;
+        if ((*key_i > *key_l) == ascending) {
+          const uint key = *key_i;
+          const int id = *id_i;
+          *key_i = *key_l;
+          *id_i = *id_l;
+          *key_l = key;
+          *id_l = id;
+        }
+      }
+
+      // One step of the bitonic sort, when elements j apart are in different
+      // work-groups.
+      __kernel void bitonic_sort_global(__global uint *keys, __global int *ids,
+                                        const uint k, const uint j,
+                                        __global const int *leaf_count) {
+        const uint i = get_global_id(0);
+        const uint l = i ^ j;
+        if (l <= i || *leaf_count == 0)
+          return;
+
+        uint key_i = keys[i], key_l = keys[l];
+        int id_i = ids[i], id_l = ids[l];
+        bitonic_compare(&key_i, &id_i, &key_l, &id_l, i, k);
+        keys[i] = key_i;
+        keys[l] = key_l;
+        ids[i] = id_i;
+        ids[l] = id_l;
+      }
+
+      // All the steps of the bitonic sort from sequence size k_begin to
+      // k_end, when compared elements are in the same work-group. The first
+      // sequence starts at step j_begin.
+      __kernel void bitonic_sort_local(__global uint *keys, __global int *ids,
+                                       const uint k_begin, const uint k_end,
+                                       const uint j_begin,
+                                       __local uint *local_keys,
+                                       __local int *local_ids,
+                                       __global const int *leaf_count) {
+        const uint i = get_global_id(0);
+        const uint lid = get_local_id(0);
+        // Same for the whole work-group, before any barrier.
+        if (*leaf_count == 0)
+          return;
+
+        local_keys[lid] = keys[i];
+        local_ids[lid] = ids[i];
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        for (uint k = k_begin; k <= k_end; k <<= 1) {
+          for (uint j = (k == k_begin) ? j_begin : k / 2; j > 0; j >>= 1) {
+            const uint l = lid ^ j;
+            if (l > lid) {
+              uint key_i = local_keys[lid], key_l = local_keys[l];
+              int id_i = local_ids[lid], id_l = local_ids[l];
+              bitonic_compare(&key_i, &id_i, &key_l, &id_l, i, k);
+              local_keys[lid] = key_i;
+              local_keys[l] = key_l;
+              local_ids[lid] = id_i;
+              local_ids[l] = id_l;
+            }
+            barrier(CLK_LOCAL_MEM_FENCE);
+          }
+        }
+
+        keys[i] = local_keys[lid];
+        ids[i] = local_ids[lid];
+      }
+
+      // Length of the common prefix of sorted keys i and j, -1 if j is out of
+      // range. Duplicate keys are told apart by their index.
+      int common_prefix(__global const uint *keys, const int num_leaves,
+                        const int i, const int j) {
+        if (j < 0 || j >= num_leaves)
+          return -1;
+        const uint key_i = keys[i];
+        const uint key_j = keys[j];
+        if (key_i == key_j)
+          return 32 + clz((uint)(i ^ j));
+        return clz(key_i ^ key_j);
+      }
+
+      // One work-item per internal node: finds the range of keys covered by
+      // the node, then where it splits (Karras 2012).
+      __kernel void build_lbvh(__global const uint *keys, __global Node *nodes,
+                               __global const int *leaf_count) {
+        const int num_leaves = *leaf_count;
+        const int i = get_global_id(0);
+        if (i >= num_leaves - 1)
+          return;
+        const int first_leaf = num_leaves - 1;
+
+        // Direction of the range.
+        const int d = common_prefix(keys, num_leaves, i, i + 1) -
+                              common_prefix(keys, num_leaves, i, i - 1) >
+                          0
+                          ? 1
+                          : -1;
+
+        // Upper bound of the range length, then binary search of the end.
+        const int min_prefix = common_prefix(keys, num_leaves, i, i - d);
+        int max_len = 2;
+        while (common_prefix(keys, num_leaves, i, i + max_len * d) >
+               min_prefix)
+          max_len *= 2;
+        int len = 0;
+        for (int t = max_len / 2; t >= 1; t /= 2) {
+          if (common_prefix(keys, num_leaves, i, i + (len + t) * d) >
+              min_prefix)
+            len += t;
+        }
+        const int j = i + len * d;
+
+        // Binary search of the split position.
+        const int node_prefix = common_prefix(keys, num_leaves, i, j);
+        int split = 0;
+        for (int div = 2;; div *= 2) {
+          const int t = (len + div - 1) / div;
+          if (common_prefix(keys, num_leaves, i, i + (split + t) * d) >
+              node_prefix)
+            split += t;
+          if (t <= 1)
+            break;
+        }
+        const int gamma = i + split * d + min(d, 0);
+
+        const int left = (min(i, j) == gamma) ? first_leaf + gamma : gamma;
+        const int right =
+            (max(i, j) == gamma + 1) ? first_leaf + gamma + 1 : gamma + 1;
+
+        nodes[i].left = left;
+        nodes[i].right = right;
+        nodes[left].parent = i;
+        nodes[right].parent = i;
+        if (i == 0)
+          nodes[0].parent = -1;
+      }
+
+      // One work-item per leaf: sets the leaf bounds, then walks up to the
+      // root. The second child reaching a node computes its bounds, the
+      // first one stops there.
+      __kernel void refit_lbvh(__global const float4 *aabbs,
+                               __global const int *ids, __global Node *nodes,
+                               __global int *flags,
+                               __global const int *leaf_count) {
+        const int num_leaves = *leaf_count;
+        const int i = get_global_id(0);
+        if (i >= num_leaves)
+          return;
+
+        // Volatile so the bounds written by other work-items are reloaded.
+        __global volatile Node *shared_nodes = nodes;
+
+        const int leaf = num_leaves - 1 + i;
+        const int box_id = ids[i];
+        const float4 box = aabbs[box_id];
+        shared_nodes[leaf].min_x = box.x;
+        shared_nodes[leaf].min_y = box.y;
+        shared_nodes[leaf].max_x = box.z;
+        shared_nodes[leaf].max_y = box.w;
+        shared_nodes[leaf].left = box_id;
+        shared_nodes[leaf].right = -1;
+        if (num_leaves == 1) {
+          shared_nodes[leaf].parent = -1;
+          return;
+        }
+
+        int node = shared_nodes[leaf].parent;
+        while (node != -1) {
+          mem_fence(CLK_GLOBAL_MEM_FENCE);
+          if (atomic_inc(&flags[node]) == 0)
+            return; // Other child not ready yet, it will go on from here.
+
+          const int l = shared_nodes[node].left;
+          const int r = shared_nodes[node].right;
+          shared_nodes[node].min_x =
+              fmin(shared_nodes[l].min_x, shared_nodes[r].min_x);
+          shared_nodes[node].min_y =
+              fmin(shared_nodes[l].min_y, shared_nodes[r].min_y);
+          shared_nodes[node].max_x =
+              fmax(shared_nodes[l].max_x, shared_nodes[r].max_x);
+          shared_nodes[node].max_y =
+              fmax(shared_nodes[l].max_y, shared_nodes[r].max_y);
+          node = shared_nodes[node].parent;
+        }
+      }
+
+      // True if the box (min_x, min_y, max_x, max_y) overlaps the node.
+      bool overlaps_node(const float4 box, __global const Node *node) {
+        return box.x <= node->max_x && box.z >= node->min_x &&
+               box.y <= node->max_y && box.w >= node->min_y;
+      });
+}
+
+// Kernels of the parallel exclusive prefix sum. See prefix_sum.hpp.
+static const std::string scan_kernel_source() {
+  return R(
+      // Exclusive prefix sum of each block of local size elements, in local
+      // memory (Blelloch 1990). The total of each block goes to block_sums.
+      __kernel void scan_blocks(__global int *data, __global int *block_sums,
+                                const int size, __local int *temp) {
+        const int gid = get_global_id(0);
+        const int lid = get_local_id(0);
+        const int block = get_local_size(0);
+
+        temp[lid] = gid < size ? data[gid] : 0;
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        // Up-sweep: partial sums up the tree.
+        for (int offset = 1; offset < block; offset <<= 1) {
+          const int i = (lid + 1) * offset * 2 - 1;
+          if (i < block)
+            temp[i] += temp[i - offset];
+          barrier(CLK_LOCAL_MEM_FENCE);
+        }
+
+        if (lid == 0) {
+          block_sums[get_group_id(0)] = temp[block - 1];
+          temp[block - 1] = 0;
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        // Down-sweep: prefix sums down the tree.
+        for (int offset = block / 2; offset >= 1; offset >>= 1) {
+          const int i = (lid + 1) * offset * 2 - 1;
+          if (i < block) {
+            const int left = temp[i - offset];
+            temp[i - offset] = temp[i];
+            temp[i] += left;
+          }
+          barrier(CLK_LOCAL_MEM_FENCE);
+        }
+
+        if (gid < size)
+          data[gid] = temp[lid];
+      }
+
+      // Adds to each block the prefix sum of the blocks before it.
+      __kernel void add_block_sums(__global int *data,
+                                   __global const int *block_sums,
+                                   const int size) {
+        const int gid = get_global_id(0);
+        if (gid < size)
+          data[gid] += block_sums[get_group_id(0)];
+      });
+}
+
+// Kernels updating the balls and drawing them.
+static const std::string ball_kernel_source() {
   return R(
       // Must redefine the Ball struct inside the Kernel source code.
       typedef struct {
@@ -16,24 +319,152 @@ const std::string kernel_source() {
         float colors[3];
       } Ball;
 
-      __kernel void update_pos(__global Ball * balls, const int num_balls) {
+      // State of the simulation kept on the device, see ball.hpp.
+      typedef struct {
+        int substep_balls;
+        int num_balls;
+        int dropped_spawns;
+        int num_substeps;
+        float dt;
+        int step;
+        int dropped_events;
+        int stack_overflows;
+      } Sim_State;
+
+      // Collision record, see event_ring.hpp.
+      typedef struct {
+        int step;
+        int ball_a;
+        int ball_b;
+        float impulse;
+        float x;
+        float y;
+      } Collision_Event;
+
+      // Walls, given as ball_b of a Collision_Event, see event_ring.hpp.
+      enum Wall {
+        wall_bottom = -1,
+        wall_top = -2,
+        wall_left = -3,
+        wall_right = -4
+      };
+
+      // Appends a collision to the events of the step. ball_b is the other
+      // ball, or a Wall. A capacity of -1 disables the recording, events
+      // beyond the capacity are dropped.
+      void record_event(__global Collision_Event *events,
+                        __global int *event_count, const int event_capacity,
+                        __global Sim_State *state, const int ball_a,
+                        const int ball_b, const float impulse, const float x,
+                        const float y) {
+        if (event_capacity < 0)
+          return;
+        const int index =
+            event_capacity > 0 ? atomic_inc(event_count) : event_capacity;
+        if (index >= event_capacity) {
+          atomic_inc(&state->dropped_events);
+          return;
+        }
+
+        Collision_Event event;
+        event.step = state->step;
+        event.ball_a = ball_a;
+        event.ball_b = ball_b;
+        event.impulse = impulse;
+        event.x = x;
+        event.y = y;
+        events[index] = event;
+      }
+
+      // Picks the number of sub-steps of the step, so that no ball moves by
+      // more than the smallest radius in one sub-step. Ball pairs are swept,
+      // but static obstacles are not: a ball moving further could cross one
+      // and be pushed out on the wrong side. Without obstacles, only swept
+      // pairs and the clamping walls are left, and balls may move by a few
+      // radii. Single work-group reduction of the max speed and the min
+      // radius.
+      __kernel void plan_substeps(__global const Ball *balls,
+                                  __global Sim_State *state,
+                                  const int step, const int max_substeps,
+                                  const int num_obstacles,
+                                  __local float *max_speeds,
+                                  __local float *min_radii) {
+        const int num_balls = state->num_balls;
+        const int lid = get_local_id(0);
+        const int size = get_local_size(0);
+
+        float max_speed = 0.0f;
+        float min_radius = MAXFLOAT;
+        for (int i = lid; i < num_balls; i += size) {
+          const float vx = balls[i].vx;
+          const float vy = balls[i].vy;
+          max_speed = fmax(max_speed, vx * vx + vy * vy);
+          min_radius = fmin(min_radius, balls[i].radius);
+        }
+        max_speeds[lid] = max_speed;
+        min_radii[lid] = min_radius;
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        // Tree reduction, size being a power of two.
+        for (int offset = size / 2; offset > 0; offset >>= 1) {
+          if (lid < offset) {
+            max_speeds[lid] = fmax(max_speeds[lid], max_speeds[lid + offset]);
+            min_radii[lid] = fmin(min_radii[lid], min_radii[lid + offset]);
+          }
+          barrier(CLK_LOCAL_MEM_FENCE);
+        }
+
+        if (lid == 0) {
+          const float reach = num_obstacles > 0 ? 1.0f : 4.0f;
+          const float travel = sqrt(max_speeds[0]) / (reach * min_radii[0]);
+          int num_substeps = 1;
+          if (num_balls > 0)
+            num_substeps = clamp((int)ceil(travel), 1, max_substeps);
+          state->num_substeps = num_substeps;
+          state->dt = 1.0f / num_substeps;
+          state->step = step;
+        }
+      }
+
+      // Every sub-step is enqueued, up to the max. Those past the planned
+      // number step no ball, so their kernels return at once.
+      __kernel void begin_substep(__global Sim_State *state,
+                                  const int substep) {
+        state->substep_balls =
+            substep < state->num_substeps ? state->num_balls : 0;
+      }
+
+      // Also saves the positions at the start of the sub-step, which the
+      // ball collisions sweep from.
+      __kernel void update_pos(__global Ball * balls, __global float2 *starts,
+                               __global const Sim_State *state) {
+        const int num_balls = state->substep_balls;
         int id = get_global_id(0);
 
         if (id >= num_balls)
           return;
 
-        balls[id].x += balls[id].vx;
-        balls[id].y += balls[id].vy;
+        const float dt = state->dt;
+        starts[id] = (float2)(balls[id].x, balls[id].y);
+        balls[id].x += balls[id].vx * dt;
+        balls[id].y += balls[id].vy * dt;
       }
 
       __kernel void handle_wall_colls(__global Ball * balls,
-                                      const int num_balls) {
+                                      __global Sim_State *state,
+                                      __global Collision_Event *events,
+                                      __global int *event_count,
+                                      const int event_capacity) {
+        const int num_balls = state->substep_balls;
+        const float dt = state->dt;
         int global_id = get_global_id(0);
-        int local_id = get_local_id(0);
+        // 4 consecutive work-items per ball, one per wall, whatever the
+        // local size.
+        int wall = global_id % 4;
         // Get ball index associated with work-item.
         int ball_idx = global_id / 4;
 
-        if (ball_idx > num_balls)
+        if (ball_idx >= num_balls)
           return;
 
         const float y = balls[ball_idx].y;
@@ -41,7 +472,7 @@ const std::string kernel_source() {
         const float radius = balls[ball_idx].radius;
 
         // Each work_items performs an if condition.
-        switch (local_id) {
+        switch (wall) {
           // Continuous collision detection for upper and lower walls.
         case 0: // Bottom boundary.
           // Check for collisions.
@@ -51,21 +482,26 @@ const std::string kernel_source() {
             const float vy0 = balls[ball_idx].vy; // Initial speed.
             // For the duration of the frame, the acceleration is non-existent.
             const float y0 =
-                balls[ball_idx].y - vy0 -
+                balls[ball_idx].y - vy0 * dt -
                 balls[ball_idx]
                     .radius; // Position of bottom Ball before collision.
             const float time =
-                (-y0 - 1) / vy0; // Exact time of collision [0,1];
+                (-y0 - 1) / vy0; // Exact time of collision [0,dt];
 
             // But we will update the ball speed according to its acceleration.
             balls[ball_idx].vy =
                 -(vy0 - gravity * time); // Continuous collision detection.
             balls[ball_idx].y =
                 -1.0f + balls[ball_idx].radius; // Rectify position of ball.
+            record_event(events, event_count, event_capacity, state,
+                         ball_idx, wall_bottom,
+                         balls[ball_idx].mass *
+                             fabs(balls[ball_idx].vy - vy0),
+                         x, -1.0f);
           }
           // If no collision at bottom, can update with gravity.
           else {
-            balls[ball_idx].vy += balls[ball_idx].gravity;
+            balls[ball_idx].vy += balls[ball_idx].gravity * dt;
           }
           break;
         case 1: // Top boundary.
@@ -75,24 +511,39 @@ const std::string kernel_source() {
             const float vy0 = balls[ball_idx].vy; // Initial speed.
             // For the duration of the frame, the acceleration is non-existent.
             const float y0 =
-                balls[ball_idx].y - vy0 +
+                balls[ball_idx].y - vy0 * dt +
                 balls[ball_idx]
                     .radius; // Position of bottom Ball before collision.
-            const float time = (1 - y0) / vy0; // Exact time of collision [0,1]
+            const float time = (1 - y0) / vy0; // Exact time of collision [0,dt]
 
             balls[ball_idx].vy = -(vy0 + gravity * time);
             balls[ball_idx].y = 1.0f - balls[ball_idx].radius;
+            record_event(events, event_count, event_capacity, state,
+                         ball_idx, wall_top,
+                         balls[ball_idx].mass *
+                             fabs(balls[ball_idx].vy - vy0),
+                         x, 1.0f);
           }
           break;
           // Left and right walls.
         case 2:
           if ((x - radius) < -1.0f) {
+            record_event(events, event_count, event_capacity, state,
+                         ball_idx, wall_left,
+                         2.0f * balls[ball_idx].mass *
+                             fabs(balls[ball_idx].vx),
+                         -1.0f, y);
             balls[ball_idx].vx = -balls[ball_idx].vx;
             balls[ball_idx].x = -1.0f + balls[ball_idx].radius;
           }
           break;
         case 3:
           if ((x + radius) > 1.0f) {
+            record_event(events, event_count, event_capacity, state,
+                         ball_idx, wall_right,
+                         2.0f * balls[ball_idx].mass *
+                             fabs(balls[ball_idx].vx),
+                         1.0f, y);
             balls[ball_idx].vx = -balls[ball_idx].vx;
             balls[ball_idx].x = 1.0f - balls[ball_idx].radius;
           }
@@ -100,43 +551,234 @@ const std::string kernel_source() {
         }
       }
 
+      // Static obstacle, see scene.hpp.
+      typedef struct {
+        float x0;
+        float y0;
+        float x1;
+        float y1;
+        float radius;
+      } Obstacle;
+
+      // Collisions with the static obstacles. Each ball only tests the
+      // obstacles of the grid cells its box overlaps.
+      __kernel void handle_obstacle_colls(__global Ball * balls,
+                                          __global const Obstacle *obstacles,
+                                          __global const int *cell_start,
+                                          __global const int *cell_items,
+                                          const int grid_size,
+                                          __global const Sim_State *state) {
+        const int num_balls = state->substep_balls;
+        const int id = get_global_id(0);
+        if (id >= num_balls)
+          return;
+
+        float x = balls[id].x;
+        float y = balls[id].y;
+        float vx = balls[id].vx;
+        float vy = balls[id].vy;
+        const float radius = balls[id].radius;
+        const float cell_size = 2.0f / grid_size;
+
+        // Cells overlapped by the ball.
+        const int last = grid_size - 1;
+        const int min_cx =
+            clamp((int)floor((x - radius + 1.0f) / cell_size), 0, last);
+        const int max_cx =
+            clamp((int)floor((x + radius + 1.0f) / cell_size), 0, last);
+        const int min_cy =
+            clamp((int)floor((y - radius + 1.0f) / cell_size), 0, last);
+        const int max_cy =
+            clamp((int)floor((y + radius + 1.0f) / cell_size), 0, last);
+
+        for (int cy = min_cy; cy <= max_cy; cy++) {
+          for (int cx = min_cx; cx <= max_cx; cx++) {
+            const int cell = cy * grid_size + cx;
+            for (int k = cell_start[cell]; k < cell_start[cell + 1]; k++) {
+              const Obstacle obstacle = obstacles[cell_items[k]];
+
+              // Closest point of the obstacle segment.
+              const float ex = obstacle.x1 - obstacle.x0;
+              const float ey = obstacle.y1 - obstacle.y0;
+              const float length2 = ex * ex + ey * ey;
+              float t = 0.0f;
+              if (length2 > 0.0f)
+                t = clamp(((x - obstacle.x0) * ex + (y - obstacle.y0) * ey) /
+                              length2,
+                          0.0f, 1.0f);
+              const float px = obstacle.x0 + t * ex;
+              const float py = obstacle.y0 + t * ey;
+
+              const float dx = x - px;
+              const float dy = y - py;
+              const float reach = radius + obstacle.radius;
+              const float distance2 = dx * dx + dy * dy;
+              if (distance2 >= reach * reach)
+                continue;
+
+              // Contact normal, pointing towards the ball.
+              const float distance = sqrt(distance2);
+              float nx = 0.0f, ny = 1.0f;
+              if (distance > 0.0f) {
+                nx = dx / distance;
+                ny = dy / distance;
+              } else if (length2 > 0.0f) {
+                const float length = sqrt(length2);
+                nx = -ey / length;
+                ny = ex / length;
+              }
+
+              // Pushes the ball out, then reflects its speed if it is still
+              // moving into the obstacle. Checked against the next obstacles
+              // from the corrected position.
+              x = px + nx * reach;
+              y = py + ny * reach;
+              const float vn = vx * nx + vy * ny;
+              if (vn < 0.0f) {
+                vx -= 2.0f * vn * nx;
+                vy -= 2.0f * vn * ny;
+              }
+            }
+          }
+        }
+
+        balls[id].x = x;
+        balls[id].y = y;
+        balls[id].vx = vx;
+        balls[id].vy = vy;
+      }
+
+      // Box enclosing the ball over the whole sub-step, from its position
+      // at the start to the current one. Not x - v * dt: walls, obstacles
+      // and earlier contacts may have changed the speed since.
+      float4 swept_box(const Ball ball, const float2 start) {
+        return (float4)(fmin(start.x, ball.x) - ball.radius,
+                        fmin(start.y, ball.y) - ball.radius,
+                        fmax(start.x, ball.x) + ball.radius,
+                        fmax(start.y, ball.y) + ball.radius);
+      }
+
+      // First contact of two balls moving in straight lines over the
+      // sub-step. (dx, dy) and (wx, wy) are their offset at the end of the
+      // sub-step and their relative speed. Returns the time of contact
+      // relative to the end, in [-dt, 0], -dt if they already overlap at the
+      // start, and 1 if they do not touch.
+      float time_of_impact(const float dx, const float dy, const float wx,
+                           const float wy, const float reach,
+                           const float dt) {
+        const float sx = dx - wx * dt;
+        const float sy = dy - wy * dt;
+        if (sx * sx + sy * sy < reach * reach)
+          return -dt;
+
+        // Smallest root of |d + w * t| = reach.
+        const float a = wx * wx + wy * wy;
+        const float b = dx * wx + dy * wy;
+        const float c = dx * dx + dy * dy - reach * reach;
+        const float discriminant = b * b - a * c;
+        if (a == 0.0f || discriminant < 0.0f)
+          return 1.0f;
+        const float time = (-b - sqrt(discriminant)) / a;
+        if (time < -dt || time > 0.0f)
+          return 1.0f;
+        return time;
+      }
+
+      // Enclosing box of every ball over the sub-step, for the broad phase,
+      // or of its current position only if not swept. Grown by margin times
+      // the radius, for solvers moving the balls after the build.
+      __kernel void compute_ball_aabbs(__global const Ball *balls,
+                                       __global const float2 *starts,
+                                       __global float4 *aabbs,
+                                       __global const Sim_State *state,
+                                       const float margin, const int swept) {
+        const int num_balls = state->substep_balls;
+        const int id = get_global_id(0);
+        if (id >= num_balls)
+          return;
+
+        float2 start;
+        start.x = balls[id].x;
+        start.y = balls[id].y;
+        if (swept)
+          start = starts[id];
+        const float grow = margin * balls[id].radius;
+        const float4 box = swept_box(balls[id], start);
+        aabbs[id] = (float4)(box.x - grow, box.y - grow, box.z + grow,
+                             box.w + grow);
+      }
+
       __kernel void handle_ball_colls(__global Ball * balls,
-                                      const int num_balls) {
+                                      __global const float2 *starts,
+                                      __global const Node *nodes,
+                                      __global Sim_State *state,
+                                      __global Collision_Event *events,
+                                      __global int *event_count,
+                                      const int event_capacity) {
+        const int num_balls = state->substep_balls;
+        const float dt = state->dt;
         int global_id = get_global_id(0);
-        int local_id = get_local_id(0);
-        int local_size = get_local_size(0);
 
         if (global_id >= num_balls)
           return;
 
         // Used when collisions b/w two balls.
-        __local Ball local_balls[2];
+        // Private to the work-item: shared local memory would be written by
+        // every work-item of the group at once.
+        Ball local_balls[2];
 
-        for (int j = global_id + 1; j < num_balls; j++) {
-          float dx = balls[global_id].x - balls[j].x;
-          float dy = balls[global_id].y - balls[j].y;
+        // Candidates come from the BVH. Each pair is handled by its ball of
+        // lowest index.
+        const int first_leaf = num_balls - 1;
+        int stack[64];
+        int stack_size = 0;
+        stack[stack_size++] = 0; // Root.
+        bool overflowed = false; // Some subtree was skipped.
+
+        while (stack_size > 0) {
+          const int node = stack[--stack_size];
+          const float x = balls[global_id].x;
+          const float y = balls[global_id].y;
+          const float radius = balls[global_id].radius;
+          const float4 box = swept_box(balls[global_id], starts[global_id]);
+
+          if (!overlaps_node(box, &nodes[node]))
+            continue;
+          if (node < first_leaf) {
+            if (stack_size + 2 <= 64) {
+              stack[stack_size++] = nodes[node].left;
+              stack[stack_size++] = nodes[node].right;
+            } else {
+              overflowed = true;
+            }
+            continue;
+          }
+
+          const int j = nodes[node].left;
+          if (j <= global_id)
+            continue;
+
+          float dx = x - balls[j].x;
+          float dy = y - balls[j].y;
+          float radiusSum = radius + balls[j].radius;
           float distance = sqrt(dx * dx + dy * dy);
-          float radiusSum = balls[global_id].radius + balls[j].radius;
+          // Mean speeds over the sub-step, from the start positions: the
+          // speeds themselves may have been flipped or exchanged since.
+          const float ux = (x - starts[global_id].x) / dt;
+          const float uy = (y - starts[global_id].y) / dt;
+          const float other_ux = (balls[j].x - starts[j].x) / dt;
+          const float other_uy = (balls[j].y - starts[j].y) / dt;
+          const float time = time_of_impact(dx, dy, ux - other_ux,
+                                            uy - other_uy, radiusSum, dt);
 
-          // We have a collision.
-          if (distance < radiusSum) {
-            // Load relevant balls into local memory for further processing.
-            // Faster access time.
+          // We have a collision: the balls touched during the sub-step, or
+          // were overlapping and still are.
+          if (time > -dt ? time <= 0.0f : distance < radiusSum) {
+            // Load relevant balls into private memory for further
+            // processing. Faster access time.
             local_balls[0] = balls[global_id];
             local_balls[1] = balls[j];
 
-            // Corrects the overlapping between the balls colliding.
-            float unit_normal[2] = {dx / distance, dy / distance};
-            const float pen_depth = radiusSum - distance;
-            // Correction to apply in x and y coordinates to both balls.
-            const float correction[2] = {unit_normal[0] * (pen_depth / 2),
-                                         unit_normal[1] * (pen_depth / 2)};
-
-            local_balls[0].x += correction[0];
-            local_balls[0].y += correction[1];
-            local_balls[1].x -= correction[0];
-            local_balls[1].y -= correction[1];
-
             // Perform elastic collision.
             // Simple speed exchange. Does not implicate mass.
             const float temp_vx = local_balls[0].vx;
@@ -147,28 +789,534 @@ const std::string kernel_source() {
             local_balls[1].vx = temp_vx;
             local_balls[1].vy = temp_vy;
 
+            // Contact point, between the centers at the time of contact.
+            const float contact_time = time > -dt ? time : 0.0f;
+            const float x0 = x + ux * contact_time;
+            const float y0 = y + uy * contact_time;
+            const float x1 = balls[j].x + other_ux * contact_time;
+            const float y1 = balls[j].y + other_uy * contact_time;
+            const float share = radius / radiusSum;
+            record_event(events, event_count, event_capacity, state,
+                         global_id, j,
+                         local_balls[0].mass *
+                             sqrt((local_balls[0].vx - temp_vx) *
+                                      (local_balls[0].vx - temp_vx) +
+                                  (local_balls[0].vy - temp_vy) *
+                                      (local_balls[0].vy - temp_vy)),
+                         x0 + (x1 - x0) * share, y0 + (y1 - y0) * share);
+
+            if (time > -dt) {
+              // Moves both balls back to the contact, then for the rest of
+              // the sub-step with their new speed.
+              local_balls[0].x += (ux - local_balls[0].vx) * time;
+              local_balls[0].y += (uy - local_balls[0].vy) * time;
+              local_balls[1].x += (other_ux - local_balls[1].vx) * time;
+              local_balls[1].y += (other_uy - local_balls[1].vy) * time;
+            } else {
+              // Already overlapping at the start of the sub-step.
+              // Corrects the overlapping between the balls colliding.
+              if (distance > 0.0f) {
+                float unit_normal[2] = {dx / distance, dy / distance};
+                const float pen_depth = radiusSum - distance;
+                // Correction to apply in x and y coordinates to both balls.
+                const float correction[2] = {
+                    unit_normal[0] * (pen_depth / 2),
+                    unit_normal[1] * (pen_depth / 2)};
+
+                local_balls[0].x += correction[0];
+                local_balls[0].y += correction[1];
+                local_balls[1].x -= correction[0];
+                local_balls[1].y -= correction[1];
+              }
+            }
+
             balls[global_id] = local_balls[0];
             balls[j] = local_balls[1];
           }
         }
+
+        if (overflowed)
+          atomic_inc(&state->stack_overflows);
+      }
+
+      // Position-based solver, one Jacobi iteration: every ball gathers the
+      // corrections of all its contacts from the current positions, weighted
+      // by the inverse masses, and averages them. Nothing is written to the
+      // balls, so work-items never race.
+      __kernel void pbd_solve_contacts(__global const Ball *balls,
+                                       __global const Node *nodes,
+                                       __global Sim_State *state,
+                                       __global float2 *corrections) {
+        const int num_balls = state->substep_balls;
+        const int id = get_global_id(0);
+        if (id >= num_balls)
+          return;
+
+        const float x = balls[id].x;
+        const float y = balls[id].y;
+        const float radius = balls[id].radius;
+        const float inv_mass = 1.0f / balls[id].mass;
+        const float4 box =
+            (float4)(x - radius, y - radius, x + radius, y + radius);
+
+        float correction_x = 0.0f;
+        float correction_y = 0.0f;
+        int num_contacts = 0;
+
+        const int first_leaf = num_balls - 1;
+        int stack[64];
+        int stack_size = 0;
+        stack[stack_size++] = 0; // Root.
+        bool overflowed = false; // Some subtree was skipped.
+
+        while (stack_size > 0) {
+          const int node = stack[--stack_size];
+          if (!overlaps_node(box, &nodes[node]))
+            continue;
+          if (node < first_leaf) {
+            if (stack_size + 2 <= 64) {
+              stack[stack_size++] = nodes[node].left;
+              stack[stack_size++] = nodes[node].right;
+            } else {
+              overflowed = true;
+            }
+            continue;
+          }
+
+          const int j = nodes[node].left;
+          if (j == id)
+            continue;
+
+          const float dx = x - balls[j].x;
+          const float dy = y - balls[j].y;
+          const float distance = sqrt(dx * dx + dy * dy);
+          const float reach = radius + balls[j].radius;
+          if (distance >= reach || distance == 0.0f)
+            continue;
+
+          // This ball's share of the overlap.
+          const float share =
+              inv_mass / (inv_mass + 1.0f / balls[j].mass);
+          const float push = (reach - distance) / distance * share;
+          correction_x += dx * push;
+          correction_y += dy * push;
+          num_contacts++;
+        }
+
+        if (overflowed)
+          atomic_inc(&state->stack_overflows);
+
+        if (num_contacts > 1) {
+          correction_x /= num_contacts;
+          correction_y /= num_contacts;
+        }
+        corrections[id] = (float2)(correction_x, correction_y);
+      }
+
+      // Moves the balls by their correction, kept inside the walls. The
+      // speed gets the correction over the sub-step: contacts end up resting
+      // rather than bouncing.
+      __kernel void pbd_apply_corrections(__global Ball * balls,
+                                          __global const float2 *corrections,
+                                          __global const Sim_State *state) {
+        const int num_balls = state->substep_balls;
+        const int id = get_global_id(0);
+        if (id >= num_balls)
+          return;
+
+        const float2 correction = corrections[id];
+        const float radius = balls[id].radius;
+        const float x = clamp(balls[id].x + correction.x, -1.0f + radius,
+                              1.0f - radius);
+        const float y = clamp(balls[id].y + correction.y, -1.0f + radius,
+                              1.0f - radius);
+        const float dt = state->dt;
+        balls[id].vx += (x - balls[id].x) / dt;
+        balls[id].vy += (y - balls[id].y) / dt;
+        balls[id].x = x;
+        balls[id].y = y;
+      }
+
+      // Ball state of the fixed-point mode, see ball.hpp. Every kernel
+      // below only uses integer arithmetic on it, rounded the same way on
+      // every device: the trajectories are bit-identical everywhere.
+      typedef struct {
+        int x;
+        int y;
+        short vx;
+        short vy;
+        ushort radius;
+        short gravity;
+      } Fixed_Ball;
+
+      // Floor of the square root.
+      ulong isqrt(ulong v) {
+        ulong root = 0;
+        ulong bit = 1UL << 62;
+        while (bit > v)
+          bit >>= 2;
+        while (bit != 0) {
+          if (v >= root + bit) {
+            v -= root + bit;
+            root = (root >> 1) + bit;
+          } else {
+            root >>= 1;
+          }
+          bit >>= 2;
+        }
+        return root;
+      }
+
+      // Rounds the float state of the balls to fixed point.
+      __kernel void quantize_balls(__global const Ball *balls,
+                                   __global Fixed_Ball *fixed,
+                                   __global const Sim_State *state) {
+        const int id = get_global_id(0);
+        if (id >= state->num_balls)
+          return;
+
+        Fixed_Ball ball;
+        ball.x = convert_int_sat_rte(balls[id].x * 1073741824.0f);
+        ball.y = convert_int_sat_rte(balls[id].y * 1073741824.0f);
+        ball.vx = convert_short_sat_rte(balls[id].vx * 262144.0f);
+        ball.vy = convert_short_sat_rte(balls[id].vy * 262144.0f);
+        ball.radius = convert_ushort_sat_rte(balls[id].radius * 524288.0f);
+        ball.gravity = convert_short_sat_rte(balls[id].gravity * 262144.0f);
+        fixed[id] = ball;
+      }
+
+      // Writes the fixed-point positions and speeds back to the float
+      // balls, read by the rendering and the snapshots.
+      __kernel void dequantize_balls(__global const Fixed_Ball *fixed,
+                                     __global Ball *balls,
+                                     __global const Sim_State *state) {
+        const int id = get_global_id(0);
+        if (id >= state->num_balls)
+          return;
+
+        balls[id].x = convert_float(fixed[id].x) * (1.0f / 1073741824.0f);
+        balls[id].y = convert_float(fixed[id].y) * (1.0f / 1073741824.0f);
+        balls[id].vx = convert_float(fixed[id].vx) * (1.0f / 262144.0f);
+        balls[id].vy = convert_float(fixed[id].vy) * (1.0f / 262144.0f);
+      }
+
+      // plan_substeps on the fixed-point balls, with a tighter bound: their
+      // pairs are not swept but resolved where they stand at the end of the
+      // sub-step, so no ball moves by more than half the smallest radius,
+      // lest pairs overlap almost fully first. The speed is bounded by
+      // |vx| + |vy|, so that no square root is needed.
+      __kernel void plan_fixed_substeps(__global const Fixed_Ball *balls,
+                                        __global Sim_State *state,
+                                        const int step,
+                                        const int max_substeps,
+                                        __local int *max_speeds,
+                                        __local int *min_radii) {
+        const int num_balls = state->num_balls;
+        const int lid = get_local_id(0);
+        const int size = get_local_size(0);
+
+        int max_speed = 0;
+        int min_radius = 65535;
+        for (int i = lid; i < num_balls; i += size) {
+          const int vx = balls[i].vx;
+          const int vy = balls[i].vy;
+          max_speed = max(max_speed, (vx < 0 ? -vx : vx) + (vy < 0 ? -vy : vy));
+          min_radius = min(min_radius, (int)balls[i].radius);
+        }
+        max_speeds[lid] = max_speed;
+        min_radii[lid] = min_radius;
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        for (int offset = size / 2; offset > 0; offset >>= 1) {
+          if (lid < offset) {
+            max_speeds[lid] = max(max_speeds[lid], max_speeds[lid + offset]);
+            min_radii[lid] = min(min_radii[lid], min_radii[lid + offset]);
+          }
+          barrier(CLK_LOCAL_MEM_FENCE);
+        }
+
+        if (lid == 0) {
+          // Speeds are in 2^-18 units, radii in 2^-19 units: travel is at
+          // most half a radius for 4 * speed <= radius.
+          const int radius = max(min_radii[0], 1);
+          int num_substeps = 1;
+          if (num_balls > 0)
+            num_substeps = clamp((4 * max_speeds[0] + radius - 1) / radius,
+                                 1, max_substeps);
+          state->num_substeps = num_substeps;
+          state->dt = 1.0f / num_substeps;
+          state->step = step;
+        }
+      }
+
+      __kernel void update_fixed_pos(__global Fixed_Ball *balls,
+                                     __global const Sim_State *state) {
+        const int id = get_global_id(0);
+        if (id >= state->substep_balls)
+          return;
+
+        const int num_substeps = state->num_substeps;
+        balls[id].x += balls[id].vx * 4096 / num_substeps;
+        balls[id].y += balls[id].vy * 4096 / num_substeps;
+      }
+
+      // Bounces the balls off the walls, or lets them fall. One work-item
+      // per ball.
+      __kernel void handle_fixed_wall_colls(__global Fixed_Ball *balls,
+                                            __global const Sim_State *state) {
+        const int id = get_global_id(0);
+        if (id >= state->substep_balls)
+          return;
+
+        const int one = 1 << 30;
+        Fixed_Ball ball = balls[id];
+        const int radius = (int)ball.radius << 11;
+        int vx = ball.vx;
+        int vy = ball.vy;
+
+        if (ball.y - radius < -one) {
+          ball.y = radius - one;
+          vy = vy < 0 ? -vy : vy;
+        } else {
+          vy += ball.gravity / state->num_substeps;
+        }
+        if (ball.y + radius > one) {
+          ball.y = one - radius;
+          vy = vy > 0 ? -vy : vy;
+        }
+        if (ball.x - radius < -one) {
+          ball.x = radius - one;
+          vx = vx < 0 ? -vx : vx;
+        }
+        if (ball.x + radius > one) {
+          ball.x = one - radius;
+          vx = vx > 0 ? -vx : vx;
+        }
+
+        ball.vx = clamp(vx, -32767, 32767);
+        ball.vy = clamp(vy, -32767, 32767);
+        balls[id] = ball;
+      }
+
+      // Boxes of the fixed-point balls for the BVH, grown a little to cover
+      // the rounding to float.
+      __kernel void compute_fixed_aabbs(__global const Fixed_Ball *balls,
+                                        __global float4 *aabbs,
+                                        __global const Sim_State *state) {
+        const int id = get_global_id(0);
+        if (id >= state->substep_balls)
+          return;
+
+        const float scale = 1.0f / 1073741824.0f;
+        const float x = convert_float(balls[id].x) * scale;
+        const float y = convert_float(balls[id].y) * scale;
+        const float reach =
+            convert_float(balls[id].radius) * (1.0f / 524288.0f) + 1e-5f;
+        aabbs[id] = (float4)(x - reach, y - reach, x + reach, y + reach);
+      }
+
+      // Elastic collisions between fixed-point balls. Each ball gathers the
+      // response of all its contacts and writes only itself, in next, then
+      // applied by apply_fixed_ball_colls: the result does not depend on the
+      // order of the work-items, and integer sums on the order of the
+      // contacts. Balls also share the separation of overlapping pairs, in
+      // proportion to the mass of the other ball.
+      __kernel void handle_fixed_ball_colls(__global const Fixed_Ball *balls,
+                                            __global Fixed_Ball *next,
+                                            __global const Node *nodes,
+                                            __global Sim_State *state) {
+        const int num_balls = state->substep_balls;
+        const int id = get_global_id(0);
+        if (id >= num_balls)
+          return;
+
+        Fixed_Ball ball = balls[id];
+
+        const long radius = (long)ball.radius << 11;
+        const long mass = (long)ball.radius * ball.radius;
+        long move_x = 0;
+        long move_y = 0;
+        long dvx = 0;
+        long dvy = 0;
+
+        const float scale = 1.0f / 1073741824.0f;
+        const float reach = convert_float(radius) * scale + 1e-5f;
+        const float x = convert_float(ball.x) * scale;
+        const float y = convert_float(ball.y) * scale;
+        const float4 box =
+            (float4)(x - reach, y - reach, x + reach, y + reach);
+
+        const int first_leaf = num_balls - 1;
+        int stack[64];
+        int stack_size = 0;
+        stack[stack_size++] = 0; // Root.
+        bool overflowed = false; // Some subtree was skipped.
+
+        while (stack_size > 0) {
+          const int node = stack[--stack_size];
+          if (!overlaps_node(box, &nodes[node]))
+            continue;
+          if (node < first_leaf) {
+            if (stack_size + 2 <= 64) {
+              stack[stack_size++] = nodes[node].left;
+              stack[stack_size++] = nodes[node].right;
+            } else {
+              overflowed = true;
+            }
+            continue;
+          }
+
+          const int j = nodes[node].left;
+          if (j == id)
+            continue;
+          const Fixed_Ball other = balls[j];
+          const long dx = (long)ball.x - other.x;
+          const long dy = (long)ball.y - other.y;
+          const long radius_sum = radius + ((long)other.radius << 11);
+          if (dx >= radius_sum || -dx >= radius_sum || dy >= radius_sum ||
+              -dy >= radius_sum)
+            continue;
+          const long dist2 = dx * dx + dy * dy;
+          if (dist2 >= radius_sum * radius_sum)
+            continue;
+
+          const long other_mass = (long)other.radius * other.radius;
+          if (mass + other_mass == 0)
+            continue;
+          // Part of the response taken by this ball, in 2^-16 units.
+          const long share = (other_mass << 16) / (mass + other_mass);
+
+          const long dist = isqrt(dist2);
+          if (dist == 0) {
+            // Same center: split along x, by index.
+            move_x += (id < j ? -radius_sum : radius_sum) * share / 65536;
+            continue;
+          }
+          const long overlap = radius_sum - dist;
+          move_x += overlap * dx / dist * share / 65536;
+          move_y += overlap * dy / dist * share / 65536;
+
+          // Normal in speed units, 2^-18, so that the products fit.
+          const long nx = dx / 4096;
+          const long ny = dy / 4096;
+          const long norm2 = nx * nx + ny * ny;
+          const long approach = ((long)ball.vx - other.vx) * nx +
+                                ((long)ball.vy - other.vy) * ny;
+          if (approach < 0 && norm2 > 0) {
+            const long factor = 2 * share * approach / norm2;
+            dvx -= factor * nx / 65536;
+            dvy -= factor * ny / 65536;
+          }
+        }
+
+        if (overflowed)
+          atomic_inc(&state->stack_overflows);
+
+        ball.x += move_x;
+        ball.y += move_y;
+        ball.vx = clamp(ball.vx + dvx, -32767L, 32767L);
+        ball.vy = clamp(ball.vy + dvy, -32767L, 32767L);
+        next[id] = ball;
+      }
+
+      __kernel void apply_fixed_ball_colls(__global const Fixed_Ball *next,
+                                           __global Fixed_Ball *balls,
+                                           __global const Sim_State *state) {
+        const int id = get_global_id(0);
+        if (id >= state->substep_balls)
+          return;
+        balls[id] = next[id];
+      }
+
+      // Appends the new balls after the live ones. Spawns beyond the
+      // capacity are dropped and counted.
+      __kernel void spawn_balls(__global Ball * balls,
+                                __global const Ball *new_balls,
+                                const int num_new, __global Sim_State *state,
+                                const int capacity) {
+        const int id = get_global_id(0);
+        if (id >= num_new)
+          return;
+
+        const int index = atomic_inc(&state->num_balls);
+        if (index < capacity) {
+          balls[index] = new_balls[id];
+        } else {
+          // Every work-item past the capacity takes its increment back.
+          atomic_dec(&state->num_balls);
+          atomic_inc(&state->dropped_spawns);
+        }
+      }
+
+      // Flags the balls to keep: alive and outside of every sink.
+      // Offsets get the same flags, to be turned into a prefix sum.
+      __kernel void mark_alive(__global const Ball *balls,
+                               __global const float4 *sinks,
+                               const int num_sinks,
+                               __global const Sim_State *state,
+                               __global int *alive, __global int *offsets,
+                               const int size) {
+        const int id = get_global_id(0);
+        if (id >= size)
+          return;
+        int keep = id < state->num_balls;
+
+        for (int i = 0; keep && i < num_sinks; i++) {
+          const float4 sink = sinks[i];
+          if (balls[id].x >= sink.x && balls[id].x <= sink.z &&
+              balls[id].y >= sink.y && balls[id].y <= sink.w)
+            keep = 0;
+        }
+
+        alive[id] = keep;
+        offsets[id] = keep;
+      }
+
+      // Moves the kept balls to their offset, the exclusive prefix sum of
+      // the flags, in the other buffer. The last work-item sets the new
+      // number of balls.
+      __kernel void compact_balls(__global const Ball *balls,
+                                  __global Ball *kept_balls,
+                                  __global const int *alive,
+                                  __global const int *offsets,
+                                  __global Sim_State *state, const int size) {
+        const int id = get_global_id(0);
+        if (id >= size)
+          return;
+
+        if (alive[id])
+          kept_balls[offsets[id]] = balls[id];
+        if (id == size - 1)
+          state->num_balls = offsets[id] + alive[id];
       }
 
       // Compute the vertices of the ball, given its position, on the GPU.
+      // Launched over more balls than alive: the vertices of the others are
+      // collapsed to a point, drawing nothing.
       __kernel void compute_ball_vertices(
           __global const Ball *balls, // All balls.
           __global float3
               *vertices, // Every vertices for all balls stored (x, y, z).
-          const int num_balls, const int num_segments) {
+          __global float *colors, // RGB of every vertex.
+          __global const Sim_State *state, const int num_segments,
+          const int size) {
+        const int num_balls = state->num_balls;
         // Get the global work-item index (ball index)
         const int ball_id = get_global_id(0);
-
-        if (ball_id >= num_balls)
-          return; // Out of bounds check
+        if (ball_id >= size)
+          return;
 
         // Fetch ball data (position and radius) given global_id.
         const float3 position =
             (float3)(balls[ball_id].x, balls[ball_id].y, 1.0f);
-        const float radius = balls[ball_id].radius;
+        const float radius = ball_id < num_balls ? balls[ball_id].radius : 0.0f;
+
+        // One single color for all vertices of a Ball.
+        for (int i = 0; i < num_segments; i++) {
+          for (int c = 0; c < 3; c++)
+            colors[(ball_id * num_segments + i) * 3 + c] =
+                balls[ball_id].colors[c];
+        }
 
         // Generate vertices for the ball.
         int vertex_count = 1;
@@ -209,4 +1357,165 @@ const std::string kernel_source() {
                  vertices[i].y);
         }
       });
-};
\ No newline at end of file
+}
+
+// Kernels of the spatial queries. See spatial_query.hpp.
+static const std::string query_kernel_source() {
+  return R(
+      typedef struct {
+        int type;
+        int k;
+        float x;
+        float y;
+        float max_x;
+        float max_y;
+        float radius;
+      } Spatial_Query;
+
+      typedef struct {
+        int ball;
+        float x;
+        float y;
+        float distance;
+      } Query_Hit;
+
+      // Runs the query against the BVH of num_balls balls. Stores its first
+      // hits from hits[first] on, short of hits[max_hits], and returns their
+      // total. Nearest hits are sorted by distance, the others are not.
+      // Stack overflows are counted in state by the counting pass only.
+      int run_query(const Spatial_Query query, __global const Ball *balls,
+                    __global const Node *nodes, const int num_balls,
+                    __global Sim_State *state, __global Query_Hit *hits,
+                    const int first, const int max_hits) {
+        const bool rect = query.type == 1;
+        const bool nearest = query.type == 2;
+        const int k = nearest ? clamp(query.k, 0, 32) : 0;
+        if (num_balls == 0 || (nearest && k == 0))
+          return 0;
+
+        const float max_dist2 = query.radius * query.radius;
+        float4 box;
+        if (rect)
+          box = (float4)(query.x, query.y, query.max_x, query.max_y);
+        else
+          box = (float4)(query.x - query.radius, query.y - query.radius,
+                         query.x + query.radius, query.y + query.radius);
+
+        // Nearest balls so far, sorted by distance.
+        int best[32];
+        float best_dist2[32];
+        int num_best = 0;
+        int count = 0;
+
+        const int first_leaf = num_balls - 1;
+        int stack[64];
+        int stack_size = 0;
+        stack[stack_size++] = 0; // Root.
+        bool overflowed = false; // Some subtree was skipped.
+
+        while (stack_size > 0) {
+          const int node = stack[--stack_size];
+          if (!overlaps_node(box, &nodes[node]))
+            continue;
+          if (nearest && num_best == k) {
+            // Nodes farther than the k-th nearest ball hold none nearer.
+            const float dx = fmax(fmax(nodes[node].min_x - query.x,
+                                       query.x - nodes[node].max_x),
+                                  0.0f);
+            const float dy = fmax(fmax(nodes[node].min_y - query.y,
+                                       query.y - nodes[node].max_y),
+                                  0.0f);
+            if (dx * dx + dy * dy > best_dist2[k - 1])
+              continue;
+          }
+          if (node < first_leaf) {
+            if (stack_size + 2 <= 64) {
+              stack[stack_size++] = nodes[node].left;
+              stack[stack_size++] = nodes[node].right;
+            } else {
+              overflowed = true;
+            }
+            continue;
+          }
+
+          const int j = nodes[node].left;
+          const float x = balls[j].x;
+          const float y = balls[j].y;
+          const float dx = x - query.x;
+          const float dy = y - query.y;
+          const float dist2 = dx * dx + dy * dy;
+
+          if (nearest) {
+            if (dist2 > max_dist2 ||
+                (num_best == k && dist2 >= best_dist2[k - 1]))
+              continue;
+            // Insertion in the sorted list, dropping the farthest if full.
+            int i = num_best < k ? num_best++ : k - 1;
+            for (; i > 0 && best_dist2[i - 1] > dist2; i--) {
+              best[i] = best[i - 1];
+              best_dist2[i] = best_dist2[i - 1];
+            }
+            best[i] = j;
+            best_dist2[i] = dist2;
+            continue;
+          }
+
+          const bool inside = rect ? x >= query.x && x <= query.max_x &&
+                                         y >= query.y && y <= query.max_y
+                                   : dist2 <= max_dist2;
+          if (!inside)
+            continue;
+          if (first + count < max_hits) {
+            Query_Hit hit = {j, x, y, rect ? 0.0f : sqrt(dist2)};
+            hits[first + count] = hit;
+          }
+          count++;
+        }
+
+        if (overflowed && max_hits == 0)
+          atomic_inc(&state->stack_overflows);
+
+        if (!nearest)
+          return count;
+        for (int i = 0; i < num_best && first + i < max_hits; i++) {
+          Query_Hit hit = {best[i], balls[best[i]].x, balls[best[i]].y,
+                           sqrt(best_dist2[i])};
+          hits[first + i] = hit;
+        }
+        return num_best;
+      }
+
+      // One work-item per query, against the BVH built over the balls of
+      // the sub-step. Run twice: with no max_hits, counts the hits of each
+      // query into counts and offsets. Once offsets hold their exclusive
+      // prefix sum, stores the hits of each query from its offset on.
+      __kernel void run_queries(__global const Spatial_Query *queries,
+                                const int num_queries,
+                                __global const Ball *balls,
+                                __global const Node *nodes,
+                                __global Sim_State *state,
+                                __global int *counts, __global int *offsets,
+                                __global Query_Hit *hits,
+                                const int max_hits) {
+        const int id = get_global_id(0);
+        if (id >= num_queries)
+          return;
+
+        const int num_balls = state->substep_balls;
+        if (max_hits == 0) {
+          const int count =
+              run_query(queries[id], balls, nodes, num_balls, state, hits, 0,
+                        0);
+          counts[id] = count;
+          offsets[id] = count;
+        } else {
+          run_query(queries[id], balls, nodes, num_balls, state, hits,
+                    offsets[id], max_hits);
+        }
+      });
+}
+
+const std::string kernel_source() {
+  return lbvh_kernel_source() + scan_kernel_source() + ball_kernel_source() +
+         query_kernel_source();
+}
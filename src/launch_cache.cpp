@@ -0,0 +1,29 @@
+#include "../include/launch_cache.hpp"
+#include <fstream>
+#include <sstream>
+
+void load_launch_sizes(const std::string &path, Launch_Sizes &sizes) {
+  std::ifstream file(path);
+  std::string line;
+  while (std::getline(file, line)) {
+    if (line.empty() || line[0] == '#')
+      continue;
+    // kernel bucket local_size
+    std::istringstream values(line);
+    std::string name;
+    int exponent;
+    size_t local_size;
+    if (values >> name >> exponent >> local_size)
+      sizes[{name, exponent}] = local_size;
+  }
+}
+
+bool save_launch_sizes(const std::string &path, const Launch_Sizes &sizes) {
+  std::ofstream file(path);
+  if (!file)
+    return false;
+  file << "# kernel, log2 of the work-items, local size (0: driver's pick)\n";
+  for (const auto &[key, local_size] : sizes)
+    file << key.first << " " << key.second << " " << local_size << "\n";
+  return static_cast<bool>(file);
+}
@@ -0,0 +1,171 @@
+#include "../include/launch_tuner.hpp"
+#include <algorithm>
+#include <cctype>
+#include <limits>
+
+// Smallest power of two >= n, as an exponent.
+static int bucket(size_t n) {
+  int exponent = 0;
+  while ((size_t(1) << exponent) < n)
+    exponent++;
+  return exponent;
+}
+
+void Launch_Tuner::init(const cl::Device &device, const std::string &cache_dir,
+                        bool tune) {
+  _device = device;
+  _tune = tune;
+
+  // One file per device and driver, named after them.
+  std::string name = device.getInfo<CL_DEVICE_NAME>() + "_" +
+                     device.getInfo<CL_DRIVER_VERSION>();
+  for (char &c : name)
+    if (!std::isalnum(static_cast<unsigned char>(c)) && c != '.')
+      c = '_';
+  _cache_path = cache_dir + "/launch_" + name + ".txt";
+  load();
+}
+
+std::vector<size_t> Launch_Tuner::candidates(cl::Kernel &kernel) const {
+  size_t max_size = 1;
+  kernel.getWorkGroupInfo(_device, CL_KERNEL_WORK_GROUP_SIZE, &max_size);
+  // A one-dimensional group is also bounded by the first dimension.
+  const auto max_items = _device.getInfo<CL_DEVICE_MAX_WORK_ITEM_SIZES>();
+  if (!max_items.empty())
+    max_size = std::min(max_size, max_items[0]);
+
+  std::vector<size_t> sizes{0};
+  for (size_t size = 32; size <= std::min<size_t>(max_size, 1024); size *= 2)
+    sizes.push_back(size);
+  return sizes;
+}
+
+// Median of the times of a candidate.
+static double median(std::vector<double> times) {
+  std::nth_element(times.begin(), times.begin() + times.size() / 2,
+                   times.end());
+  return times[times.size() / 2];
+}
+
+void Launch_Tuner::enqueue(cl::CommandQueue &queue, cl::Kernel &kernel,
+                           const std::string &name, size_t n, bool timed) {
+  if (n == 0)
+    return;
+  const auto key = std::make_pair(name, bucket(n));
+
+  size_t local_size = 0;
+  cl::Event *timing = nullptr;
+  cl::Event event;
+  size_t candidate = 0;
+  auto found = _local_sizes.find(key);
+  if (found != _local_sizes.end()) {
+    local_size = found->second;
+  } else if (_tune && timed) {
+    Trial &trial = _trials[key];
+    if (trial.candidates.empty()) {
+      trial.candidates = candidates(kernel);
+      trial.times.resize(trial.candidates.size());
+    }
+    // Next candidate still lacking timings. When none is left, as after
+    // ruling out the last one, the launch is the driver's pick, untimed,
+    // until update() picks the winner.
+    const size_t num_candidates = trial.candidates.size();
+    for (size_t i = 0; i < num_candidates && !timing; i++) {
+      candidate = (trial.next + i) % num_candidates;
+      if (trial.times[candidate].size() < runs_per_candidate)
+        timing = &event;
+    }
+    if (timing) {
+      trial.next = (candidate + 1) % num_candidates;
+      local_size = trial.candidates[candidate];
+    }
+  }
+
+  try {
+    if (local_size == 0) {
+      queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(n),
+                                 cl::NullRange, nullptr, timing);
+    } else {
+      const size_t global = (n + local_size - 1) / local_size * local_size;
+      queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(global),
+                                 cl::NDRange(local_size), nullptr, timing);
+    }
+  } catch (const cl::Error &e) {
+    if (local_size == 0) {
+      std::cerr << "OpenCL Error: " << e.what() << " (" << e.err() << ")"
+                << std::endl;
+      return;
+    }
+    // Size not supported by this launch: ruled out, and the kernel launched
+    // again with the next pick.
+    if (timing) {
+      _trials[key].times[candidate].assign(
+          runs_per_candidate, std::numeric_limits<double>::max());
+    } else {
+      _local_sizes.erase(key);
+    }
+    enqueue(queue, kernel, name, n, timed);
+    return;
+  }
+  if (timing)
+    _trials[key].pending.emplace_back(event, candidate);
+}
+
+void Launch_Tuner::update() {
+  for (auto it = _trials.begin(); it != _trials.end();) {
+    Trial &trial = it->second;
+
+    // Completed timings, in launch order.
+    size_t done = 0;
+    for (; done < trial.pending.size(); done++) {
+      const cl::Event &event = trial.pending[done].first;
+      if (event.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() != CL_COMPLETE)
+        break;
+      const double time =
+          event.getProfilingInfo<CL_PROFILING_COMMAND_END>() -
+          event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+      std::vector<double> &times = trial.times[trial.pending[done].second];
+      if (times.size() < runs_per_candidate)
+        times.push_back(time);
+    }
+    trial.pending.erase(trial.pending.begin(), trial.pending.begin() + done);
+
+    const bool complete = std::all_of(
+        trial.times.begin(), trial.times.end(),
+        [](const auto &times) { return times.size() >= runs_per_candidate; });
+    if (!complete) {
+      ++it;
+      continue;
+    }
+
+    // Lowest median: robust to the odd launch slowed down, or sped up, by
+    // the rest of the queue.
+    std::vector<double> medians;
+    for (const auto &times : trial.times)
+      medians.push_back(median(times));
+    const size_t winner =
+        std::min_element(medians.begin(), medians.end()) - medians.begin();
+    _local_sizes[it->first] = trial.candidates[winner];
+    _dirty = true;
+    it = _trials.erase(it);
+  }
+
+  if (_dirty) {
+    save();
+    _dirty = false;
+  }
+}
+
+void Launch_Tuner::load() {
+  load_launch_sizes(_cache_path, _local_sizes);
+  if (!_local_sizes.empty())
+    std::cout << "Loaded " << _local_sizes.size() << " launch sizes from "
+              << _cache_path << std::endl;
+}
+
+void Launch_Tuner::save() const {
+  if (!_tune)
+    return;
+  if (!save_launch_sizes(_cache_path, _local_sizes))
+    std::cerr << "Error: cannot write " << _cache_path << std::endl;
+}
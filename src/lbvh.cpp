@@ -0,0 +1,109 @@
+#include "../include/lbvh.hpp"
+#include "../include/try_kernel.hpp"
+
+// Smallest power of two >= size.
+static size_t padded(int size) {
+  size_t padded_size = 1;
+  while (padded_size < static_cast<size_t>(size))
+    padded_size <<= 1;
+  return padded_size;
+}
+
+void LBVH::init(cl::Context &context, cl::Program &program, int max_leaves,
+                size_t max_local_size) {
+  _program = program;
+  _max_leaves = max_leaves;
+  _max_local_size = max_local_size;
+
+  // Bitonic sort works on a power of two.
+  const size_t padded_size = padded(max_leaves);
+  const size_t num_nodes = 2 * max_leaves - 1;
+  _keys = cl::Buffer(context, CL_MEM_READ_WRITE, padded_size * sizeof(cl_uint));
+  _ids = cl::Buffer(context, CL_MEM_READ_WRITE, padded_size * sizeof(cl_int));
+  // Node is 8 floats/ints wide, see kernel source.
+  _nodes =
+      cl::Buffer(context, CL_MEM_READ_WRITE, num_nodes * 8 * sizeof(cl_int));
+  _flags = cl::Buffer(context, CL_MEM_READ_WRITE,
+                      std::max(max_leaves - 1, 1) * sizeof(cl_int));
+}
+
+void LBVH::sort(cl::CommandQueue &queue, const cl::Buffer &leaf_count,
+                size_t size) {
+  static cl::Kernel global_step = try_kernel(_program, "bitonic_sort_global");
+  static cl::Kernel local_steps = try_kernel(_program, "bitonic_sort_local");
+  const size_t local_size = std::min(size, _max_local_size);
+  const cl_uint num = static_cast<cl_uint>(size);
+
+  local_steps.setArg(0, _keys);
+  local_steps.setArg(1, _ids);
+  local_steps.setArg(5, cl::Local(local_size * sizeof(cl_uint)));
+  local_steps.setArg(6, cl::Local(local_size * sizeof(cl_int)));
+  local_steps.setArg(7, leaf_count);
+  global_step.setArg(0, _keys);
+  global_step.setArg(1, _ids);
+  global_step.setArg(4, leaf_count);
+
+  // Sorts every block of local_size elements in local memory at once.
+  local_steps.setArg(2, cl_uint(2));
+  local_steps.setArg(3, cl_uint(local_size));
+  local_steps.setArg(4, cl_uint(1));
+  queue.enqueueNDRangeKernel(local_steps, cl::NullRange, cl::NDRange(num),
+                             cl::NDRange(local_size));
+
+  // Merges blocks larger than a work-group: one launch per step whose
+  // compare distance spans work-groups, then the remaining steps in local
+  // memory.
+  for (cl_uint k = 2 * local_size; k <= num; k <<= 1) {
+    for (cl_uint j = k / 2; j >= local_size; j >>= 1) {
+      global_step.setArg(2, k);
+      global_step.setArg(3, j);
+      queue.enqueueNDRangeKernel(global_step, cl::NullRange, cl::NDRange(num));
+    }
+    local_steps.setArg(2, k);
+    local_steps.setArg(3, k);
+    local_steps.setArg(4, cl_uint(local_size / 2));
+    queue.enqueueNDRangeKernel(local_steps, cl::NullRange, cl::NDRange(num),
+                               cl::NDRange(local_size));
+  }
+}
+
+void LBVH::build(cl::CommandQueue &queue, const cl::Buffer &aabbs,
+                 const cl::Buffer &leaf_count, int max_leaves) {
+  static cl::Kernel morton = try_kernel(_program, "compute_morton_codes");
+  static cl::Kernel hierarchy = try_kernel(_program, "build_lbvh");
+  static cl::Kernel refit = try_kernel(_program, "refit_lbvh");
+
+  if (max_leaves <= 0)
+    return;
+  const size_t sort_size = padded(max_leaves);
+
+  try {
+    morton.setArg(0, aabbs);
+    morton.setArg(1, _keys);
+    morton.setArg(2, _ids);
+    morton.setArg(3, leaf_count);
+    queue.enqueueNDRangeKernel(morton, cl::NullRange, cl::NDRange(sort_size));
+
+    sort(queue, leaf_count, sort_size);
+
+    if (max_leaves > 1) {
+      hierarchy.setArg(0, _keys);
+      hierarchy.setArg(1, _nodes);
+      hierarchy.setArg(2, leaf_count);
+      queue.enqueueNDRangeKernel(hierarchy, cl::NullRange,
+                                 cl::NDRange(max_leaves - 1));
+      queue.enqueueFillBuffer(_flags, cl_int(0), 0,
+                              (max_leaves - 1) * sizeof(cl_int));
+    }
+
+    refit.setArg(0, aabbs);
+    refit.setArg(1, _ids);
+    refit.setArg(2, _nodes);
+    refit.setArg(3, _flags);
+    refit.setArg(4, leaf_count);
+    queue.enqueueNDRangeKernel(refit, cl::NullRange, cl::NDRange(max_leaves));
+  } catch (const cl::Error &e) {
+    std::cerr << "OpenCL Error: " << e.what() << " (" << e.err() << ")"
+              << std::endl;
+  }
+}
@@ -1,6 +1,7 @@
 #include "../include/args.hpp"
 #include "../include/clgl_manager.hpp"
 #include "../include/fps.hpp"
+#include "../include/shm_publisher.hpp"
 #include <GLFW/glfw3.h>
 
 // Window size.
@@ -10,13 +11,32 @@ constexpr int target_fps = 60;
 
 int main(int argc, char *argv[]) {
 
-  int num_balls, num_vertices = 0;
+  Sim_Options options;
 
-  process_args(argc, argv, num_balls, num_vertices);
+  process_args(argc, argv, options);
 
-  CLGL_Manager prog(num_balls, num_vertices);
+  CLGL_Manager prog(options);
   auto window = prog.init(width, height);
 
+  // Publishes the ball state for external processes.
+  // The frames are sized once: by default, for the balls at start, not for
+  // the --max-balls limit of the emitters.
+  std::unique_ptr<Shm_Publisher> publisher;
+  if (!options.shm_name.empty())
+    publisher = std::make_unique<Shm_Publisher>(
+        options.shm_name,
+        options.shm_max_balls > 0 ? options.shm_max_balls : prog.capacity(),
+        options.shm_every, options.shm_stride);
+
+  // Replays: runs from the same seed in fixed point print the same digests
+  // on every device.
+  uint64_t step = 0;
+
+  // Collisions, summed up every second.
+  int num_collisions = 0;
+  int wall_collisions = 0;
+  int frames = 0;
+
   FPS_Counter fps_counter;
   FPS_Cap fps_cap(target_fps); // Limit FPS.
 
@@ -30,8 +50,36 @@ int main(int argc, char *argv[]) {
     glClear(GL_COLOR_BUFFER_BIT); // Clear image at each frame.
 
     prog.update_balls();
+    if (publisher)
+      publisher->update(prog);
+    if (options.digest_every > 0 && ++step % options.digest_every == 0) {
+      // Blocks, only when asked for.
+      if (auto snapshot = prog.snapshot()) {
+        snapshot->wait();
+        std::cout << "Digest at step " << step << ": " << std::hex
+                  << snapshot->digest() << std::dec << " (stack overflows: "
+                  << snapshot->state().stack_overflows << ")" << std::endl;
+      }
+    }
+
+    if (options.event_capacity > 0) {
+      Collision_Event event;
+      while (prog.events().pop(event)) {
+        num_collisions++;
+        if (event.ball_b >= wall_right && event.ball_b <= wall_bottom)
+          wall_collisions++;
+      }
+      if (++frames == target_fps) {
+        std::cout << "Collisions: " << num_collisions
+                  << " (walls: " << wall_collisions
+                  << ", dropped: " << prog.events().dropped() << ")"
+                  << std::endl;
+        num_collisions = wall_collisions = frames = 0;
+      }
+    }
 
     prog.draw_balls();
+    prog.draw_obstacles();
 
     // Swap front and back buffers.
     glfwSwapBuffers(window);
@@ -0,0 +1,53 @@
+#include "../include/prefix_sum.hpp"
+#include "../include/try_kernel.hpp"
+
+void Prefix_Sum::init(cl::Context &context, cl::Program &program,
+                      int max_size, size_t block_size) {
+  _program = program;
+  _block_size = block_size;
+  _block_sums.clear();
+
+  // One level per division by the block size, down to a single block.
+  int size = std::max(max_size, 1);
+  do {
+    size = (size + block_size - 1) / block_size;
+    _block_sums.emplace_back(context, CL_MEM_READ_WRITE, size * sizeof(int));
+  } while (size > 1);
+}
+
+void Prefix_Sum::scan(cl::CommandQueue &queue, const cl::Buffer &data,
+                      int size) {
+  if (size <= 0)
+    return;
+  try {
+    scan_level(queue, data, size, 0);
+  } catch (const cl::Error &e) {
+    std::cerr << "OpenCL Error: " << e.what() << " (" << e.err() << ")"
+              << std::endl;
+  }
+}
+
+void Prefix_Sum::scan_level(cl::CommandQueue &queue, const cl::Buffer &data,
+                            int size, size_t level) {
+  static cl::Kernel scan_blocks = try_kernel(_program, "scan_blocks");
+  static cl::Kernel add_block_sums = try_kernel(_program, "add_block_sums");
+
+  const size_t num_blocks = (size + _block_size - 1) / _block_size;
+  const cl::NDRange global(num_blocks * _block_size), local(_block_size);
+
+  scan_blocks.setArg(0, data);
+  scan_blocks.setArg(1, _block_sums[level]);
+  scan_blocks.setArg(2, size);
+  scan_blocks.setArg(3, cl::Local(_block_size * sizeof(int)));
+  queue.enqueueNDRangeKernel(scan_blocks, cl::NullRange, global, local);
+
+  if (num_blocks == 1)
+    return;
+
+  scan_level(queue, _block_sums[level], num_blocks, level + 1);
+
+  add_block_sums.setArg(0, data);
+  add_block_sums.setArg(1, _block_sums[level]);
+  add_block_sums.setArg(2, size);
+  queue.enqueueNDRangeKernel(add_block_sums, cl::NullRange, global, local);
+}
@@ -0,0 +1,24 @@
+#include "../include/query_hits.hpp"
+#include <algorithm>
+
+Query_Hits::Query_Hits(const int *counts, const int *offsets,
+                       const Query_Hit *hits, int num_queries, int max_hits)
+    : _counts(counts), _offsets(offsets), _hits(hits),
+      _num_queries(num_queries), _max_hits(max_hits) {}
+
+int Query_Hits::total() const {
+  if (_num_queries == 0)
+    return 0;
+  return _offsets[_num_queries - 1] + _counts[_num_queries - 1];
+}
+
+int Query_Hits::num_hits(size_t query) const {
+  // Hits past the capacity were dropped.
+  const int stored = std::min(total(), _max_hits) - _offsets[query];
+  return std::clamp(stored, 0, _counts[query]);
+}
+
+const Query_Hit *Query_Hits::hits(size_t query) const {
+  const int stored = std::min(total(), _max_hits);
+  return _hits + std::min(_offsets[query], stored);
+}
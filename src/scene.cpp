@@ -0,0 +1,141 @@
+#include "../include/scene.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+Scene load_scene(const std::string &path) {
+  std::ifstream file(path);
+  if (!file) {
+    std::cerr << path << ": Cannot open scene file." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  Scene scene;
+  std::string line;
+  for (int line_num = 1; std::getline(file, line); line_num++) {
+    line = line.substr(0, line.find('#'));
+    std::istringstream fields(line);
+    std::string kind;
+    if (!(fields >> kind))
+      continue; // Empty line.
+
+    std::vector<float> values;
+    float value;
+    while (fields >> value)
+      values.push_back(value);
+    if (!fields.eof()) {
+      std::cerr << path << ":" << line_num << ": Invalid number." << std::endl;
+      exit(EXIT_FAILURE);
+    }
+
+    auto expect = [&](bool valid, const char *usage) {
+      if (!valid) {
+        std::cerr << path << ":" << line_num << ": Expected " << usage << "."
+                  << std::endl;
+        exit(EXIT_FAILURE);
+      }
+    };
+
+    if (kind == "peg") {
+      expect(values.size() == 3 && values[2] > 0.0f, "peg x y radius");
+      scene.obstacles.push_back(
+          {values[0], values[1], values[0], values[1], values[2]});
+    } else if (kind == "segment") {
+      expect(values.size() == 4, "segment x0 y0 x1 y1");
+      scene.obstacles.push_back(
+          {values[0], values[1], values[2], values[3], 0.0f});
+    } else if (kind == "polygon") {
+      expect(values.size() >= 6 && values.size() % 2 == 0,
+             "polygon x0 y0 x1 y1 x2 y2 ...");
+      const size_t num_points = values.size() / 2;
+      for (size_t i = 0; i < num_points; i++) {
+        const size_t j = (i + 1) % num_points;
+        scene.obstacles.push_back({values[2 * i], values[2 * i + 1],
+                                   values[2 * j], values[2 * j + 1], 0.0f});
+      }
+    } else if (kind == "emitter") {
+      expect(values.size() == 3 && values[2] > 0.0f, "emitter x y rate");
+      scene.emitters.push_back({values[0], values[1], values[2]});
+    } else if (kind == "sink") {
+      expect(values.size() == 4, "sink x0 y0 x1 y1");
+      scene.sinks.push_back({std::min(values[0], values[2]),
+                             std::min(values[1], values[3]),
+                             std::max(values[0], values[2]),
+                             std::max(values[1], values[3])});
+    } else {
+      std::cerr << path << ":" << line_num << ": " << kind
+                << ": Unknown scene element." << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  std::cout << "Loaded " << scene.obstacles.size() << " obstacles, "
+            << scene.emitters.size() << " emitters and " << scene.sinks.size()
+            << " sinks from " << path << std::endl;
+  return scene;
+}
+
+// Distance from the point to the obstacle.
+static float distance_to(const Obstacle &obstacle, float x, float y) {
+  const float ex = obstacle.x1 - obstacle.x0;
+  const float ey = obstacle.y1 - obstacle.y0;
+  const float length2 = ex * ex + ey * ey;
+  float t = 0.0f;
+  if (length2 > 0.0f)
+    t = std::clamp(((x - obstacle.x0) * ex + (y - obstacle.y0) * ey) / length2,
+                   0.0f, 1.0f);
+  const float dx = x - (obstacle.x0 + t * ex);
+  const float dy = y - (obstacle.y0 + t * ey);
+  return std::sqrt(dx * dx + dy * dy) - obstacle.radius;
+}
+
+Obstacle_Grid build_obstacle_grid(const std::vector<Obstacle> &obstacles) {
+  Obstacle_Grid grid;
+  // About one obstacle per cell.
+  grid.size = std::clamp(
+      static_cast<int>(std::ceil(std::sqrt(float(obstacles.size())))), 1, 256);
+  const float cell_size = 2.0f / grid.size;
+  const float half_diagonal = cell_size * 0.7072f;
+  const int num_cells = grid.size * grid.size;
+
+  auto cell_of = [&grid, cell_size](float coord) {
+    return std::clamp(static_cast<int>(std::floor((coord + 1.0f) / cell_size)),
+                      0, grid.size - 1);
+  };
+
+  // Cells covered by each obstacle: within its bounding box, the cells whose
+  // center is close enough to the obstacle. Stored as (cell, obstacle).
+  std::vector<std::pair<int, int>> entries;
+  for (size_t i = 0; i < obstacles.size(); i++) {
+    const Obstacle &obstacle = obstacles[i];
+    const float radius = obstacle.radius;
+    const int min_x = cell_of(std::min(obstacle.x0, obstacle.x1) - radius);
+    const int max_x = cell_of(std::max(obstacle.x0, obstacle.x1) + radius);
+    const int min_y = cell_of(std::min(obstacle.y0, obstacle.y1) - radius);
+    const int max_y = cell_of(std::max(obstacle.y0, obstacle.y1) + radius);
+
+    for (int cy = min_y; cy <= max_y; cy++) {
+      for (int cx = min_x; cx <= max_x; cx++) {
+        const float center_x = -1.0f + (cx + 0.5f) * cell_size;
+        const float center_y = -1.0f + (cy + 0.5f) * cell_size;
+        if (distance_to(obstacle, center_x, center_y) <= half_diagonal)
+          entries.emplace_back(cy * grid.size + cx, i);
+      }
+    }
+  }
+  std::sort(entries.begin(), entries.end());
+
+  grid.cell_start.assign(num_cells + 1, 0);
+  grid.items.reserve(entries.size());
+  for (const auto &entry : entries) {
+    grid.cell_start[entry.first + 1]++;
+    grid.items.push_back(entry.second);
+  }
+  for (int c = 0; c < num_cells; c++)
+    grid.cell_start[c + 1] += grid.cell_start[c];
+
+  return grid;
+}
@@ -0,0 +1,59 @@
+#include "../include/shm_reader.hpp"
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <thread>
+
+// Demo consumer of the ring published with --shm.
+// Prints once per second the frames received and skipped, with the kinetic
+// energy and center of mass of the last frame.
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    std::cerr << "Usage: " << argv[0] << " /shm_name" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  Shm_Reader reader;
+  if (!reader.open(argv[1]))
+    return EXIT_FAILURE;
+
+  Shm_Frame_View frame;
+  uint64_t received = 0, torn = 0;
+  auto start = std::chrono::steady_clock::now();
+
+  while (true) {
+    if (!reader.acquire(frame)) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      continue;
+    }
+
+    // Reads in place, then drops the result if the frame was overwritten.
+    double energy = 0.0, mass = 0.0, x = 0.0, y = 0.0;
+    for (uint32_t i = 0; i < frame.num_balls; i++) {
+      const Ball &ball = frame.balls[i];
+      energy += 0.5 * ball.mass * (ball.vx * ball.vx + ball.vy * ball.vy);
+      mass += ball.mass;
+      x += ball.mass * ball.x;
+      y += ball.mass * ball.y;
+    }
+    if (!reader.validate(frame)) {
+      torn++;
+      continue;
+    }
+    received++;
+
+    auto now = std::chrono::steady_clock::now();
+    if (now - start >= std::chrono::seconds(1)) {
+      std::cout << "step " << frame.step << ": " << received << " frames, "
+                << reader.skipped() << " skipped, " << torn << " torn"
+                << " | balls " << frame.num_balls << " (1/" << frame.stride
+                << ") energy " << energy;
+      // No center without balls.
+      if (mass > 0.0)
+        std::cout << " center (" << x / mass << ", " << y / mass << ")";
+      std::cout << std::endl;
+      received = 0;
+      start = now;
+    }
+  }
+}
@@ -0,0 +1,24 @@
+#include "../include/shm_publisher.hpp"
+
+Shm_Publisher::Shm_Publisher(const std::string &name, int max_balls, int every,
+                             int stride, int num_slots)
+    : _every(std::max(every, 1)), _stride(std::max(stride, 1)),
+      _writer(name, (std::max(max_balls, 0) + _stride - 1) / _stride,
+              num_slots) {}
+
+void Shm_Publisher::update(CLGL_Manager &prog) {
+  if (_num_steps++ % _every == 0) {
+    // Null when every snapshot slot is still pending: this step is skipped.
+    auto snapshot = prog.snapshot();
+    if (snapshot)
+      _pending.push_back(std::move(snapshot));
+  }
+
+  // In order, as long as the copies have landed.
+  while (!_pending.empty() && _pending.front()->ready()) {
+    const Ball_Snapshot &snapshot = *_pending.front();
+    _writer.write(snapshot.step(), snapshot.balls(), snapshot.num_balls(),
+                  _stride);
+    _pending.pop_front();
+  }
+}
@@ -0,0 +1,81 @@
+#include "../include/shm_reader.hpp"
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+Shm_Reader::~Shm_Reader() {
+  if (_header)
+    munmap(_header, _size);
+}
+
+bool Shm_Reader::open(const std::string &name) {
+  const int fd = shm_open(name.c_str(), O_RDONLY, 0);
+  if (fd == -1) {
+    std::cerr << name << ": " << strerror(errno) << std::endl;
+    return false;
+  }
+
+  struct stat info;
+  fstat(fd, &info);
+  _size = info.st_size;
+  void *addr = mmap(nullptr, _size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    std::cerr << name << ": " << strerror(errno) << std::endl;
+    return false;
+  }
+
+  _header = static_cast<Shm_Header *>(addr);
+  if (_size < sizeof(Shm_Header) || _header->magic != shm_magic ||
+      _header->version != shm_version ||
+      _size < shm_segment_size(_header->num_slots, _header->max_balls)) {
+    std::cerr << name << ": Not a bouncing ball ring." << std::endl;
+    munmap(_header, _size);
+    _header = nullptr;
+    return false;
+  }
+
+  // Starts from the newest frame.
+  const uint64_t head = _header->head.load(std::memory_order_acquire);
+  _next_frame = head > 0 ? head - 1 : 0;
+  return true;
+}
+
+bool Shm_Reader::acquire(Shm_Frame_View &view) {
+  const uint64_t head = _header->head.load(std::memory_order_acquire);
+  if (head == 0 || head - 1 < _next_frame)
+    return false;
+
+  // Only the newest frame is of interest, older ones are skipped.
+  const uint64_t frame = head - 1;
+  Shm_Slot *slot = shm_slot(_header, frame % _header->num_slots);
+  if (slot->seq.load(std::memory_order_acquire) != 2 * frame + 2)
+    return false; // Already being overwritten.
+
+  _skipped += frame - _next_frame;
+  _next_frame = frame + 1;
+
+  view.frame = frame;
+  view.step = slot->step;
+  view.num_balls = std::min(slot->num_balls, _header->max_balls);
+  view.stride = slot->stride;
+  view.balls = shm_slot_balls(slot);
+  return true;
+}
+
+bool Shm_Reader::validate(const Shm_Frame_View &view) const {
+  std::atomic_thread_fence(std::memory_order_acquire);
+  const Shm_Slot *slot = shm_slot(_header, view.frame % _header->num_slots);
+  return slot->seq.load(std::memory_order_relaxed) == 2 * view.frame + 2;
+}
+
+bool Shm_Reader::read(Shm_Frame_View &view, std::vector<Ball> &balls) {
+  if (!acquire(view))
+    return false;
+  balls.assign(view.balls, view.balls + view.num_balls);
+  return validate(view);
+}
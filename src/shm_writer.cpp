@@ -0,0 +1,71 @@
+#include "../include/shm_writer.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/mman.h>
+#include <unistd.h>
+
+Shm_Writer::Shm_Writer(const std::string &name, uint32_t max_balls,
+                       uint32_t num_slots)
+    : _name(name) {
+  _size = shm_segment_size(num_slots, max_balls);
+
+  // Truncated: nothing of an earlier run is left for the readers.
+  const int fd = shm_open(_name.c_str(), O_CREAT | O_TRUNC | O_RDWR, 0644);
+  if (fd == -1 || ftruncate(fd, _size) == -1) {
+    std::cerr << _name << ": " << strerror(errno) << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  void *addr =
+      mmap(nullptr, _size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    std::cerr << _name << ": " << strerror(errno) << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  _header = static_cast<Shm_Header *>(addr);
+  // Invalid to the readers until set up, even if the segment was shared.
+  _header->magic = 0;
+  std::atomic_thread_fence(std::memory_order_release);
+  _header->num_slots = num_slots;
+  _header->max_balls = max_balls;
+  _header->slot_size = shm_slot_size(max_balls);
+  _header->head.store(0, std::memory_order_relaxed);
+  for (uint32_t i = 0; i < num_slots; i++)
+    shm_slot(_header, i)->seq.store(0, std::memory_order_relaxed);
+  _header->version = shm_version;
+  // Readers check the magic last.
+  std::atomic_thread_fence(std::memory_order_release);
+  _header->magic = shm_magic;
+}
+
+Shm_Writer::~Shm_Writer() {
+  munmap(_header, _size);
+  shm_unlink(_name.c_str());
+}
+
+void Shm_Writer::write(uint64_t step, const Ball *balls, int num_balls,
+                       int stride) {
+  stride = std::max(stride, 1);
+  const uint64_t frame = _header->head.load(std::memory_order_relaxed);
+  Shm_Slot *slot = shm_slot(_header, frame % _header->num_slots);
+
+  // Marks the slot as being written.
+  slot->seq.store(2 * frame + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  Ball *slot_balls = shm_slot_balls(slot);
+  uint32_t count = 0;
+  for (int i = 0; i < num_balls && count < _header->max_balls; i += stride)
+    slot_balls[count++] = balls[i];
+  slot->step = step;
+  slot->num_balls = count;
+  slot->stride = stride;
+
+  slot->seq.store(2 * frame + 2, std::memory_order_release);
+  _header->head.store(frame + 1, std::memory_order_release);
+}
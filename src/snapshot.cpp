@@ -0,0 +1,94 @@
+#include "../include/snapshot.hpp"
+
+Snapshot_Slot::Snapshot_Slot(cl::Context &context, cl::CommandQueue &queue,
+                             int max_balls)
+    : queue(queue) {
+  const size_t size = std::max(max_balls, 1) * sizeof(Ball);
+  try {
+    staging =
+        cl::Buffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, size);
+    mapped = static_cast<Ball *>(
+        queue.enqueueMapBuffer(staging, CL_TRUE, CL_MAP_READ, 0, size));
+  } catch (const cl::Error &e) {
+    std::cerr << "OpenCL Error: " << e.what() << " (" << e.err() << ")"
+              << std::endl;
+  }
+}
+
+Snapshot_Slot::~Snapshot_Slot() {
+  if (mapped)
+    queue.enqueueUnmapMemObject(staging, mapped);
+}
+
+bool Ball_Snapshot::ready() const {
+  return _done.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() == CL_COMPLETE;
+}
+
+void Ball_Snapshot::wait() const { _done.wait(); }
+
+uint64_t Ball_Snapshot::digest() const {
+  uint64_t hash = 14695981039346656037ull;
+  for (int i = 0; i < num_balls(); i++) {
+    const float values[4] = {balls()[i].x, balls()[i].y, balls()[i].vx,
+                             balls()[i].vy};
+    const auto *bytes = reinterpret_cast<const unsigned char *>(values);
+    for (size_t j = 0; j < sizeof(values); j++)
+      hash = (hash ^ bytes[j]) * 1099511628211ull;
+  }
+  return hash;
+}
+
+void Snapshot_Pool::init(cl::Context &context, cl::CommandQueue &queue,
+                         int max_balls, int num_slots) {
+  _slots.clear();
+  for (int i = 0; i < num_slots; i++)
+    _slots.push_back(
+        std::make_shared<Snapshot_Slot>(context, queue, max_balls));
+}
+
+std::shared_ptr<const Ball_Snapshot>
+Snapshot_Pool::take(cl::CommandQueue &queue, const cl::Buffer &balls,
+                    const cl::Buffer &state, int max_balls, uint64_t step) {
+  // Find a free slot.
+  std::shared_ptr<Snapshot_Slot> slot;
+  for (auto &candidate : _slots) {
+    bool in_use = false;
+    if (candidate->mapped &&
+        candidate->in_use.compare_exchange_strong(in_use, true)) {
+      slot = candidate;
+      break;
+    }
+  }
+  if (!slot)
+    return nullptr;
+
+  auto snapshot = new Ball_Snapshot;
+  snapshot->_slot = slot;
+  snapshot->_copied = max_balls;
+  snapshot->_step = step;
+
+  try {
+    queue.enqueueReadBuffer(state, CL_FALSE, 0, sizeof(Sim_State),
+                            &slot->state);
+    if (max_balls > 0)
+      queue.enqueueReadBuffer(balls, CL_FALSE, 0, max_balls * sizeof(Ball),
+                              slot->mapped, nullptr, &snapshot->_done);
+    else
+      queue.enqueueMarkerWithWaitList(nullptr, &snapshot->_done);
+  } catch (const cl::Error &e) {
+    std::cerr << "OpenCL Error: " << e.what() << " (" << e.err() << ")"
+              << std::endl;
+    slot->in_use = false;
+    delete snapshot;
+    return nullptr;
+  }
+
+  // The slot is free again once the snapshot is released. A snapshot still
+  // being copied waits for the copy to finish first.
+  return std::shared_ptr<const Ball_Snapshot>(
+      snapshot, [](const Ball_Snapshot *released) {
+        released->wait();
+        released->_slot->in_use = false;
+        delete released;
+      });
+}
@@ -0,0 +1,161 @@
+#include "../include/spatial_query.hpp"
+#include "../include/try_kernel.hpp"
+#include <algorithm>
+
+Spatial_Query circle_query(float x, float y, float radius) {
+  return Spatial_Query{query_circle, 0, x, y, x, y, radius};
+}
+
+Spatial_Query rect_query(float min_x, float min_y, float max_x, float max_y) {
+  return Spatial_Query{query_rect, 0, min_x, min_y, max_x, max_y, 0.0f};
+}
+
+Spatial_Query nearest_query(float x, float y, int k, float max_distance) {
+  return Spatial_Query{query_nearest, std::clamp(k, 0, 32), x, y, x, y,
+                       max_distance};
+}
+
+bool Query_Batch::ready() const {
+  return !_done() ||
+         _done.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() == CL_COMPLETE;
+}
+
+void Query_Batch::wait() const {
+  if (_done())
+    _done.wait();
+}
+
+Query_Hits Query_Batch::stored() const {
+  if (_num_queries == 0)
+    return Query_Hits();
+  return Query_Hits(_slot->counts.data(), _slot->offsets.data(),
+                    _slot->hits.data(), _num_queries, _max_hits);
+}
+
+void Spatial_Queries::init(cl::Context &context, cl::Program &program,
+                           size_t block_size) {
+  _context = context;
+  _program = program;
+  _block_size = block_size;
+  _max_queries = 0;
+}
+
+std::shared_ptr<Query_Batch>
+Spatial_Queries::run(cl::CommandQueue &queue,
+                     const std::vector<Spatial_Query> &queries, int max_hits,
+                     const cl::Buffer &balls, const cl::Buffer &nodes,
+                     const cl::Buffer &state) {
+  static cl::Kernel kernel = try_kernel(_program, "run_queries");
+
+  const int num_queries = queries.size();
+  max_hits = std::max(max_hits, 0);
+  if (num_queries == 0)
+    return std::make_shared<Query_Batch>();
+
+  // Find a free slot, or add one.
+  std::shared_ptr<Query_Slot> slot;
+  for (auto &candidate : _slots) {
+    bool in_use = false;
+    if (candidate->in_use.compare_exchange_strong(in_use, true)) {
+      slot = candidate;
+      break;
+    }
+  }
+  if (!slot) {
+    slot = std::make_shared<Query_Slot>();
+    slot->in_use = true;
+    _slots.push_back(slot);
+  }
+
+  auto batch = new Query_Batch;
+  batch->_slot = slot;
+  batch->_num_queries = num_queries;
+  batch->_max_hits = max_hits;
+
+  try {
+    if (num_queries > _max_queries) {
+      _max_queries = std::max(num_queries, 2 * _max_queries);
+      _prefix_sum.init(_context, _program, _max_queries, _block_size);
+    }
+
+    // Slots only grow, doubling like the prefix sum.
+    if (num_queries > slot->max_queries) {
+      const int size = std::max(num_queries, 2 * slot->max_queries);
+      slot->queries_buffer = cl::Buffer(_context, CL_MEM_READ_ONLY,
+                                        size * sizeof(Spatial_Query));
+      slot->counts_buffer =
+          cl::Buffer(_context, CL_MEM_READ_WRITE, size * sizeof(cl_int));
+      slot->offsets_buffer =
+          cl::Buffer(_context, CL_MEM_READ_WRITE, size * sizeof(cl_int));
+      slot->queries.resize(size);
+      slot->counts.resize(size);
+      slot->offsets.resize(size);
+      slot->max_queries = size;
+    }
+    if (max_hits > slot->max_hits || slot->max_hits == 0) {
+      const int size = std::max({max_hits, 2 * slot->max_hits, 1});
+      slot->hits_buffer =
+          cl::Buffer(_context, CL_MEM_READ_WRITE, size * sizeof(Query_Hit));
+      slot->hits.resize(size);
+      slot->max_hits = size;
+    }
+
+    std::copy(queries.begin(), queries.end(), slot->queries.begin());
+    queue.enqueueWriteBuffer(slot->queries_buffer, CL_FALSE, 0,
+                             num_queries * sizeof(Spatial_Query),
+                             slot->queries.data());
+
+    kernel.setArg(0, slot->queries_buffer);
+    kernel.setArg(1, num_queries);
+    kernel.setArg(2, balls);
+    kernel.setArg(3, nodes);
+    kernel.setArg(4, state);
+    kernel.setArg(5, slot->counts_buffer);
+    kernel.setArg(6, slot->offsets_buffer);
+    kernel.setArg(7, slot->hits_buffer);
+
+    // Counts the hits of each query, then stores them at the prefix sum of
+    // the counts.
+    kernel.setArg(8, 0);
+    queue.enqueueNDRangeKernel(kernel, cl::NullRange,
+                               cl::NDRange(num_queries));
+    _prefix_sum.scan(queue, slot->offsets_buffer, num_queries);
+    if (max_hits > 0) {
+      kernel.setArg(8, max_hits);
+      queue.enqueueNDRangeKernel(kernel, cl::NullRange,
+                                 cl::NDRange(num_queries));
+    }
+
+    // Read back right after the passes, in order: the batch is ready once
+    // the last read has completed. The whole capacity is read, the hit count
+    // being unknown to the host until then.
+    queue.enqueueReadBuffer(slot->counts_buffer, CL_FALSE, 0,
+                            num_queries * sizeof(cl_int),
+                            slot->counts.data());
+    queue.enqueueReadBuffer(slot->offsets_buffer, CL_FALSE, 0,
+                            num_queries * sizeof(cl_int),
+                            slot->offsets.data(), nullptr,
+                            max_hits > 0 ? nullptr : &batch->_done);
+    if (max_hits > 0)
+      queue.enqueueReadBuffer(slot->hits_buffer, CL_FALSE, 0,
+                              max_hits * sizeof(Query_Hit),
+                              slot->hits.data(), nullptr, &batch->_done);
+    queue.flush();
+  } catch (const cl::Error &e) {
+    std::cerr << "OpenCL Error: " << e.what() << " (" << e.err() << ")"
+              << std::endl;
+    // Reads already enqueued must land before the slot is reused.
+    queue.finish();
+    batch->_done = cl::Event();
+    batch->_num_queries = 0;
+  }
+
+  // The slot is free again once the batch is released. A batch still being
+  // read back waits for the reads to finish first.
+  return std::shared_ptr<Query_Batch>(batch, [](Query_Batch *released) {
+    released->wait();
+    if (released->_slot)
+      released->_slot->in_use = false;
+    delete released;
+  });
+}
@@ -1,7 +0,0 @@
-#include <mlpack.hpp>
-
-int main() {
-
-  //
-  return 0;
-}
\ No newline at end of file
@@ -0,0 +1,13 @@
+#include "../include/try_kernel.hpp"
+
+cl::Kernel try_kernel(cl::Program &prog, const std::string &fn_name) {
+  cl::Kernel kernel;
+  try {
+    kernel = cl::Kernel(prog, fn_name);
+  } catch (const cl::Error &e) {
+    std::cerr << "OpenCL Error: " << e.what() << " (" << e.err() << ")"
+              << std::endl;
+    exit(1);
+  }
+  return kernel;
+}
\ No newline at end of file
@@ -0,0 +1,13 @@
+#pragma once
+#include <cstdlib>
+#include <iostream>
+
+// Fails the test when the condition does not hold, in every build type.
+#define CHECK(condition)                                                       \
+  do {                                                                         \
+    if (!(condition)) {                                                        \
+      std::cerr << __FILE__ << ":" << __LINE__                                 \
+                << ": Check failed: " #condition << std::endl;                 \
+      std::exit(EXIT_FAILURE);                                                 \
+    }                                                                          \
+  } while (0)
@@ -0,0 +1,54 @@
+#include "../include/ball.hpp"
+#include "check.hpp"
+#include <vector>
+
+// Draws n balls of the distribution from a fixed seed.
+static std::vector<Ball> draw(Radius_Dist radius_dist, int n) {
+  std::mt19937 gen(42);
+  std::vector<Ball> balls;
+  for (int i = 0; i < n; i++)
+    balls.push_back(create_ball(gen, radius_dist));
+  return balls;
+}
+
+int main() {
+  const int n = 10000;
+
+  // Every ball has the largest radius.
+  for (const Ball &ball : draw(Radius_Dist::fixed, n))
+    CHECK(ball.radius == 0.075f);
+
+  // A few radii, each picked about a third of the time.
+  int counts[3] = {0, 0, 0};
+  for (const Ball &ball : draw(Radius_Dist::mixed, n)) {
+    CHECK(ball.radius == 0.025f || ball.radius == 0.050f ||
+          ball.radius == 0.075f);
+    counts[ball.radius == 0.025f ? 0 : ball.radius == 0.050f ? 1 : 2]++;
+  }
+  for (int count : counts)
+    CHECK(count > n / 4 && count < n / 2);
+
+  // Within the bounds, many small balls and a few large ones.
+  int small = 0, large = 0;
+  for (const Ball &ball : draw(Radius_Dist::long_tail, n)) {
+    CHECK(ball.radius >= 0.005f * 0.999f && ball.radius <= 0.100f * 1.001f);
+    small += ball.radius < 0.010f;
+    large += ball.radius > 0.050f;
+  }
+  CHECK(small > n / 2);
+  CHECK(large > 0 && large < n / 50);
+
+  // Masses follow the area, and balls spawn away from the borders.
+  for (const Ball &ball : draw(Radius_Dist::long_tail, 100)) {
+    CHECK(ball.mass == ball.radius * ball.radius);
+    CHECK(ball.x >= -0.85f && ball.x <= 0.85f);
+    CHECK(ball.y >= -0.85f && ball.y <= 0.85f);
+  }
+
+  // The radii depend on the seed only.
+  const std::vector<Ball> first = draw(Radius_Dist::long_tail, 100);
+  const std::vector<Ball> second = draw(Radius_Dist::long_tail, 100);
+  for (size_t i = 0; i < first.size(); i++)
+    CHECK(first[i].radius == second[i].radius);
+  return 0;
+}
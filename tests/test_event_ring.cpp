@@ -0,0 +1,42 @@
+#include "../include/event_ring.hpp"
+#include "check.hpp"
+
+// Event told apart by its step.
+static Collision_Event make_event(int step) {
+  return Collision_Event{step, 0, wall_bottom, 1.0f, 0.0f, -1.0f};
+}
+
+int main() {
+  Event_Ring ring;
+  Collision_Event event;
+
+  // With no room, every event is lost.
+  ring.init(0);
+  ring.push(make_event(0));
+  CHECK(!ring.pop(event));
+  CHECK(ring.overwritten() == 1);
+
+  // Oldest first.
+  ring.init(4);
+  CHECK(ring.overwritten() == 0);
+  CHECK(!ring.pop(event));
+  for (int step = 0; step < 3; step++)
+    ring.push(make_event(step));
+  CHECK(ring.size() == 3);
+  CHECK(ring.pop(event) && event.step == 0 && event.ball_b == wall_bottom);
+
+  // Wraps around the end of the storage, overwriting the oldest when full.
+  for (int step = 3; step < 8; step++)
+    ring.push(make_event(step));
+  CHECK(ring.size() == 4);
+  CHECK(ring.overwritten() == 3);
+  for (int step = 4; step < 8; step++)
+    CHECK(ring.pop(event) && event.step == step);
+  CHECK(!ring.pop(event));
+  CHECK(ring.size() == 0);
+
+  // Keeps working once drained.
+  ring.push(make_event(8));
+  CHECK(ring.pop(event) && event.step == 8);
+  return 0;
+}
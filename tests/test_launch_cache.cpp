@@ -0,0 +1,41 @@
+#include "../include/launch_cache.hpp"
+#include "check.hpp"
+#include <filesystem>
+#include <fstream>
+#include <unistd.h>
+
+int main() {
+  const auto path = std::filesystem::temp_directory_path() /
+                    ("ball_test_launch_" + std::to_string(getpid()) + ".txt");
+
+  // A missing cache is an empty one.
+  Launch_Sizes sizes;
+  load_launch_sizes(path.string(), sizes);
+  CHECK(sizes.empty());
+
+  // Saved sizes are loaded back as they were.
+  const Launch_Sizes saved = {{{"update_pos", 10}, 64},
+                              {{"update_pos", 18}, 256},
+                              {{"refit_lbvh", 18}, 0}};
+  CHECK(save_launch_sizes(path.string(), saved));
+  load_launch_sizes(path.string(), sizes);
+  CHECK(sizes == saved);
+
+  // Comments, blank and malformed lines are skipped, the sizes already
+  // known are kept, and the file wins over them.
+  std::ofstream(path) << "# Comment.\n"
+                      << "\n"
+                      << "compact_balls 12 128\n"
+                      << "update_pos 10 32\n"
+                      << "truncated 12\n";
+  load_launch_sizes(path.string(), sizes);
+  CHECK(sizes.size() == 4);
+  CHECK((sizes[{"compact_balls", 12}] == 128));
+  CHECK((sizes[{"update_pos", 10}] == 32));
+  CHECK((sizes[{"update_pos", 18}] == 256));
+  CHECK(sizes.count({"truncated", 12}) == 0);
+
+  std::filesystem::remove(path);
+  CHECK(!save_launch_sizes("/nonexistent/dir/launch.txt", saved));
+  return 0;
+}
@@ -0,0 +1,71 @@
+#include "../include/query_hits.hpp"
+#include "check.hpp"
+#include <algorithm>
+#include <vector>
+
+// Lays out the hits of the counts as the kernels do: the counts are scanned
+// into offsets, then each query stores its hits from its offset on, as long
+// as they fit in max_hits. Hit i of query q is ball 100 * q + i.
+struct Layout {
+  std::vector<int> counts;
+  std::vector<int> offsets;
+  std::vector<Query_Hit> hits;
+  int max_hits;
+
+  Layout(const std::vector<int> &query_counts, int max_hits)
+      : counts(query_counts), offsets(query_counts.size()),
+        hits(std::max(max_hits, 1)), max_hits(max_hits) {
+    int total = 0;
+    for (size_t q = 0; q < counts.size(); q++) {
+      offsets[q] = total;
+      total += counts[q];
+    }
+    for (size_t q = 0; q < counts.size(); q++)
+      for (int i = 0; i < counts[q] && offsets[q] + i < max_hits; i++)
+        hits[offsets[q] + i].ball = 100 * q + i;
+  }
+
+  Query_Hits view() const {
+    return Query_Hits(counts.data(), offsets.data(), hits.data(),
+                      counts.size(), max_hits);
+  }
+};
+
+int main() {
+  const std::vector<int> counts = {2, 0, 3, 1};
+
+  // Every hit fits: each query gets all of its own hits.
+  const Layout full(counts, 6);
+  const Query_Hits all = full.view();
+  CHECK(all.total() == 6 && !all.truncated());
+  for (size_t q = 0; q < counts.size(); q++) {
+    CHECK(all.num_hits(q) == counts[q]);
+    for (int i = 0; i < counts[q]; i++)
+      CHECK(all.hits(q)[i].ball == int(100 * q + i));
+  }
+
+  // Truncated in the middle of query 2: it keeps its first hits, query 3
+  // none, and no query reads past the stored ones.
+  const Layout cut(counts, 4);
+  const Query_Hits some = cut.view();
+  CHECK(some.total() == 6 && some.truncated());
+  CHECK(some.num_hits(0) == 2 && some.num_hits(1) == 0);
+  CHECK(some.num_hits(2) == 2);
+  CHECK(some.hits(2)[0].ball == 200 && some.hits(2)[1].ball == 201);
+  CHECK(some.num_hits(3) == 0);
+  CHECK(some.hits(3) == some.hits(0) + 4);
+
+  // No room: everything is counted, nothing stored.
+  const Layout none(counts, 0);
+  const Query_Hits counted = none.view();
+  CHECK(counted.total() == 6 && counted.truncated());
+  for (size_t q = 0; q < counts.size(); q++)
+    CHECK(counted.num_hits(q) == 0);
+
+  // Queries without hits, and empty batches.
+  const Layout empty({0, 0}, 8);
+  CHECK(empty.view().total() == 0 && !empty.view().truncated());
+  CHECK(empty.view().num_hits(1) == 0);
+  CHECK(Query_Hits().total() == 0 && !Query_Hits().truncated());
+  return 0;
+}
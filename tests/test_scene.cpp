@@ -0,0 +1,82 @@
+#include "../include/scene.hpp"
+#include "check.hpp"
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Writes the text to a scene file of the temporary directory.
+static std::string write_scene(const std::string &text) {
+  const auto path = std::filesystem::temp_directory_path() /
+                    ("ball_test_scene_" + std::to_string(getpid()) + ".txt");
+  std::ofstream(path) << text;
+  return path.string();
+}
+
+// True if loading the scene exits with a failure, as on invalid lines.
+static bool rejected(const std::string &text) {
+  const std::string path = write_scene(text);
+  const pid_t pid = fork();
+  if (pid == 0) {
+    // Quiet: the errors are expected.
+    std::cerr.setstate(std::ios::failbit);
+    std::cout.setstate(std::ios::failbit);
+    load_scene(path);
+    _exit(EXIT_SUCCESS);
+  }
+  int status = 0;
+  waitpid(pid, &status, 0);
+  std::filesystem::remove(path);
+  return WIFEXITED(status) && WEXITSTATUS(status) == EXIT_FAILURE;
+}
+
+int main() {
+  const std::string path = write_scene("# Comment.\n"
+                                       "\n"
+                                       "peg 0.1 0.2 0.05 # Trailing comment.\n"
+                                       "segment -0.5 0 0.5 0\n"
+                                       "polygon 0 0 1 0 0 1\n"
+                                       "emitter 0 0.9 0.5\n"
+                                       "sink 0.5 -0.8 -0.5 -1\n");
+  const Scene scene = load_scene(path);
+  std::filesystem::remove(path);
+
+  // A peg is a zero length capsule, a segment a capsule of zero radius.
+  CHECK(scene.obstacles.size() == 5);
+  const Obstacle &peg = scene.obstacles[0];
+  CHECK(peg.x0 == 0.1f && peg.y0 == 0.2f && peg.x1 == 0.1f && peg.y1 == 0.2f);
+  CHECK(peg.radius == 0.05f);
+  const Obstacle &segment = scene.obstacles[1];
+  CHECK(segment.x0 == -0.5f && segment.x1 == 0.5f && segment.radius == 0.0f);
+
+  // A polygon is closed: its last edge goes back to the first vertex.
+  const Obstacle &last_edge = scene.obstacles[4];
+  CHECK(last_edge.x0 == 0.0f && last_edge.y0 == 1.0f);
+  CHECK(last_edge.x1 == 0.0f && last_edge.y1 == 0.0f);
+
+  CHECK(scene.emitters.size() == 1);
+  CHECK(scene.emitters[0].y == 0.9f && scene.emitters[0].rate == 0.5f);
+
+  // Sink corners are sorted.
+  CHECK(scene.sinks.size() == 1);
+  const Sink &sink = scene.sinks[0];
+  CHECK(sink.min_x == -0.5f && sink.min_y == -1.0f);
+  CHECK(sink.max_x == 0.5f && sink.max_y == -0.8f);
+
+  // Every obstacle is indexed in the cells it overlaps.
+  const Obstacle_Grid grid = build_obstacle_grid(scene.obstacles);
+  CHECK(grid.cell_start.size() == size_t(grid.size * grid.size + 1));
+  CHECK(grid.cell_start.back() == int(grid.items.size()));
+  for (int obstacle = 0; obstacle < int(scene.obstacles.size()); obstacle++)
+    CHECK(std::count(grid.items.begin(), grid.items.end(), obstacle) > 0);
+
+  CHECK(rejected("peg 0 0\n"));
+  CHECK(rejected("peg 0 0 -0.1\n"));
+  CHECK(rejected("polygon 0 0 1 1\n"));
+  CHECK(rejected("segment 0 0 x 1\n"));
+  CHECK(rejected("emitter 0 0 0\n"));
+  CHECK(rejected("wall 0 0 1 1\n"));
+  CHECK(!rejected("# Nothing.\n"));
+  return 0;
+}
@@ -0,0 +1,89 @@
+#include "../include/shm_reader.hpp"
+#include "../include/shm_writer.hpp"
+#include "check.hpp"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <vector>
+
+// Balls told apart by their x.
+static std::vector<Ball> make_balls(int n) {
+  std::vector<Ball> balls(n, Ball{});
+  for (int i = 0; i < n; i++)
+    balls[i].x = float(i);
+  return balls;
+}
+
+int main() {
+  const std::string name = "/ball_test_" + std::to_string(getpid());
+  const std::vector<Ball> balls = make_balls(100);
+  std::vector<Ball> read;
+  Shm_Frame_View view;
+
+  {
+    Shm_Writer writer(name, 40, 4);
+    Shm_Reader reader;
+    CHECK(reader.open(name));
+    CHECK(!reader.acquire(view)); // Nothing published yet.
+
+    // Every other ball, cut short past the 40 of a slot.
+    writer.write(7, balls.data(), balls.size(), 2);
+    CHECK(reader.read(view, read));
+    CHECK(view.frame == 0 && view.step == 7 && view.stride == 2);
+    CHECK(view.num_balls == 40 && read.size() == 40);
+    for (int i = 0; i < 40; i++)
+      CHECK(read[i].x == float(2 * i));
+    CHECK(!reader.acquire(view)); // Already seen.
+
+    // A slow reader skips to the newest frame.
+    for (int step = 8; step < 11; step++)
+      writer.write(step, balls.data(), 10);
+    CHECK(reader.read(view, read));
+    CHECK(view.frame == 3 && view.step == 10 && view.num_balls == 10);
+    CHECK(reader.skipped() == 2);
+
+    // A frame overwritten while it is read is torn: its slot comes round
+    // again after 4 frames.
+    writer.write(11, balls.data(), 10);
+    CHECK(reader.acquire(view));
+    CHECK(reader.validate(view));
+    for (int step = 12; step < 16; step++)
+      writer.write(step, balls.data(), 10);
+    CHECK(!reader.validate(view));
+
+    // A slot is odd while being written: the frame is not acquired yet.
+    const int fd = shm_open(name.c_str(), O_RDWR, 0);
+    CHECK(fd != -1);
+    const size_t size = shm_segment_size(4, 40);
+    void *addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    CHECK(addr != MAP_FAILED);
+    writer.write(16, balls.data(), 10); // Frame 9.
+    Shm_Slot *slot = shm_slot(static_cast<Shm_Header *>(addr), 9 % 4);
+    CHECK(slot->seq.load() == 2 * 9 + 2);
+    slot->seq.store(2 * 9 + 1);
+    CHECK(!reader.acquire(view));
+    slot->seq.store(2 * 9 + 2);
+    CHECK(reader.acquire(view) && view.frame == 9 && view.step == 16);
+    munmap(addr, size);
+  }
+
+  // A ring left by an earlier run is reset when created again.
+  {
+    Shm_Writer first(name, 10, 2);
+    first.write(1, balls.data(), 10);
+    Shm_Writer second(name, 10, 2);
+    Shm_Reader reader;
+    CHECK(reader.open(name));
+    CHECK(!reader.acquire(view));
+    second.write(2, balls.data(), 5);
+    CHECK(reader.read(view, read));
+    CHECK(view.frame == 0 && view.step == 2 && view.num_balls == 5);
+  }
+
+  // Removed with its writer.
+  Shm_Reader reader;
+  std::cerr.setstate(std::ios::failbit);
+  CHECK(!reader.open(name));
+  return 0;
+}